@@ -16,6 +16,7 @@
 
 #include "proxyserver.h"
 #include "safequeue.h"
+#include "spscring.h"
 
 
 /*
@@ -35,8 +36,41 @@ char *fileserver_ipaddr;
 int fileserver_port;
 int max_queue_size;
 int server_fd;
+int fast_path;
 // Global variable for the priority queue
 priority_queue* queue;
+// Global variable for the per worker inboxes used instead of the priority queue in fast path mode
+worker_inbox** inboxes;
+
+// Global counters for the latency between a listener accepting a connection and a worker starting on it
+unsigned long handoff_count;
+unsigned long handoff_total_ns;
+unsigned long handoff_max_ns;
+
+// Function to record the handoff latency of a request that a worker is about to start on
+void record_handoff_latency(struct timespec accepted) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long latency_ns = (now.tv_sec - accepted.tv_sec) * 1000000000UL + (now.tv_nsec - accepted.tv_nsec);
+
+    __atomic_fetch_add(&handoff_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&handoff_total_ns, latency_ns, __ATOMIC_RELAXED);
+    unsigned long max_ns = __atomic_load_n(&handoff_max_ns, __ATOMIC_RELAXED);
+    while (latency_ns > max_ns &&
+           !__atomic_compare_exchange_n(&handoff_max_ns, &max_ns, latency_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void print_handoff_stats() {
+    unsigned long count = __atomic_load_n(&handoff_count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        return;
+    }
+    printf("Handoff latency (%s): %lu requests, avg %.1f us, max %.1f us\n",
+           fast_path ? "fast path" : "priority queue", count,
+           __atomic_load_n(&handoff_total_ns, __ATOMIC_RELAXED) / 1000.0 / count,
+           __atomic_load_n(&handoff_max_ns, __ATOMIC_RELAXED) / 1000.0);
+}
 
 void send_error_response(int client_fd, status_code_t err_code, char *err_msg) {
     http_start_response(client_fd, err_code);
@@ -108,6 +142,23 @@ void serve_request(int client_fd) {
     free(buffer);
 }
 
+// Function to handle a request a worker took from the priority queue or from its rings
+void handle_request(int client_fd, int delay, struct timespec accepted) {
+    record_handoff_latency(accepted);
+
+    // Put worker thread to sleep if request has a delay parameter specified
+    if(delay > 0) {
+        // printf("Worker Thread is sleeping for %d seconds\n", delay);
+        sleep(delay);
+    }
+
+    // Serve the request by forwarding it to the file server and returning the response received to the client
+    serve_request(client_fd);
+
+    shutdown(client_fd, SHUT_WR);
+    close(client_fd);
+}
+
 // Function which gets executed by each worker thread
 void *request_work(void* arg) {
     int worker_thread_id = *(int *)arg;
@@ -115,6 +166,13 @@ void *request_work(void* arg) {
 
     // Loop indefinitely
     while(1) {
+        if(fast_path) {
+            // Retrieve the next request handed directly to this worker by any listener
+            ring_request request = inbox_get_work(inboxes[worker_thread_id]);
+            handle_request(request.client_fd, request.delay, request.accepted);
+            continue;
+        }
+
         // Retrieve the highest prioirty request from the queue if a request exists
         queue_request request = get_work(queue);
 
@@ -122,17 +180,7 @@ void *request_work(void* arg) {
         
         // print_queue(queue);
 
-        // Put worker thread to sleep if request has a delay parameter specified
-        if(request.delay > 0) {
-            // printf("Worker Thread %d is sleeping for %d seconds\n", worker_thread_id, request.delay);
-            sleep(request.delay);
-        }
-
-        // Serve the request by forwarding it to the file server and returning the response received to the client
-        serve_request(request.client_fd);
-
-        shutdown(request.client_fd, SHUT_WR);
-        close(request.client_fd);
+        handle_request(request.client_fd, request.delay, request.accepted);
     }
 
     pthread_exit(NULL);
@@ -185,6 +233,9 @@ void *request_listen(void *arg) {
     struct sockaddr_in client_address;
     size_t client_address_length = sizeof(client_address);
     int client_fd;
+    struct timespec accepted;
+    // Worker that the next request is handed to in fast path mode
+    int next_worker = 0;
     // Loop indefinitely
     while (1) {
         client_fd = accept(server_fd,
@@ -194,6 +245,7 @@ void *request_listen(void *arg) {
             perror("Error accepting socket");
             continue;
         }
+        clock_gettime(CLOCK_MONOTONIC, &accepted);
 
         printf("Listener %d Accepted connection from %s on port %d\n",
                 listener_thread_id,
@@ -222,6 +274,14 @@ void *request_listen(void *arg) {
             continue;
         }
 
+        // Rings can only be drained by the worker owning them, so there is no job to hand out in fast path mode
+        if(isWorkerRequest == -1 && fast_path) {
+            send_error_response(client_fd, BAD_REQUEST, "GetJob requests aren't supported in fast path mode");
+            shutdown(client_fd, SHUT_WR);
+            close(client_fd);
+            continue;
+        }
+
         // GetJob request is handled by the client itself
         if(isWorkerRequest == -1) {
             // Retrieve the highest prioirty request from the queue if a request exists
@@ -245,8 +305,27 @@ void *request_listen(void *arg) {
         }
 
 
+        // In fast path mode, hand the request directly to the next worker whose ring from this listener has space
+        if(fast_path) {
+            int res = -1;
+            for(int i = 0; i < num_workers && res == -1; i++) {
+                int worker = (next_worker + i) % num_workers;
+                res = ring_push(inboxes[worker]->rings[listener_thread_id], client_fd, delay, request->path, accepted);
+                if(res == 0) {
+                    inbox_notify(inboxes[worker]);
+                    next_worker = (worker + 1) % num_workers;
+                }
+            }
+            if(res == -1) {
+                send_error_response(client_fd, QUEUE_FULL, "All worker rings are full and request can't be handled");
+                shutdown(client_fd, SHUT_WR);
+                close(client_fd);
+            }
+            continue;
+        }
+
         // If it isn't a GetJob request, add the request to the priority queue so that it can be picked by a worker thread
-        int res = add_work(queue, client_fd, request_priority, delay, request->path);
+        int res = add_work(queue, client_fd, request_priority, delay, request->path, accepted);
         if(res == -1) {
             // Queue is full scenario
             // printf("Reached Queue is full scenario\n");
@@ -347,6 +426,8 @@ void default_settings() {
     fileserver_port = 3333;
 
     max_queue_size = 100;
+
+    fast_path = 0;
 }
 
 void print_settings() {
@@ -358,11 +439,13 @@ void print_settings() {
     printf("\t%d workers\n", num_workers);
     printf("\tfileserver ipaddr %s port %d\n", fileserver_ipaddr, fileserver_port);
     printf("\tmax queue size  %d\n", max_queue_size);
+    printf("\tfast path %s\n", fast_path ? "on" : "off");
     printf("\t  ----\t----\t\n");
 }
 
 void signal_callback_handler(int signum) {
     printf("Caught signal %d: %s\n", signum, strsignal(signum));
+    print_handoff_stats();
     for (int i = 0; i < num_listener; i++) {
         if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
     }
@@ -371,7 +454,7 @@ void signal_callback_handler(int signum) {
 }
 
 char *USAGE =
-    "Usage: ./proxyserver [-l 1 8000] [-n 1] [-i 127.0.0.1 -p 3333] [-q 100]\n";
+    "Usage: ./proxyserver [-l 1 8000] [-n 1] [-i 127.0.0.1 -p 3333] [-q 100] [-f]\n";
 
 void exit_with_usage() {
     fprintf(stderr, "%s", USAGE);
@@ -401,6 +484,8 @@ int main(int argc, char **argv) {
             fileserver_ipaddr = argv[++i];
         } else if (strcmp("-p", argv[i]) == 0) {
             fileserver_port = atoi(argv[++i]);
+        } else if (strcmp("-f", argv[i]) == 0) {
+            fast_path = 1;
         } else {
             fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
             exit_with_usage();
@@ -412,6 +497,19 @@ int main(int argc, char **argv) {
     // Create a priority queue of max queue size
     queue =  create_queue(max_queue_size);
 
+    // Create an inbox per worker with a ring from every listener when priority ordering isn't needed. The max queue
+    // size is split evenly over the rings, each of which holds at least one request
+    if(fast_path) {
+        int ring_size = max_queue_size / (num_workers * num_listener);
+        if(ring_size < 1) {
+            ring_size = 1;
+        }
+        inboxes = (worker_inbox**)malloc(num_workers * sizeof(worker_inbox*));
+        for(int i = 0; i < num_workers; i++) {
+            inboxes[i] = create_inbox(num_listener, ring_size);
+        }
+    }
+
     pthread_t listener_threads[num_listener];
     pthread_t worker_threads[num_workers];
 
@@ -444,7 +542,7 @@ int main(int argc, char **argv) {
     }
 
     // Wait for worker threads
-    for(int i = 0; i < num_listener; i++) {
+    for(int i = 0; i < num_workers; i++) {
         if(pthread_join(worker_threads[i], NULL) != 0) {
             perror("Unable to wait for worker threads");
             exit(1);
@@ -452,6 +550,15 @@ int main(int argc, char **argv) {
     }
 
     printf("All threads have finished.\n");
+
+    // Free the inboxes and the priority queue now that no thread uses them
+    if(fast_path) {
+        for(int i = 0; i < num_workers; i++) {
+            delete_inbox(inboxes[i]);
+        }
+        free(inboxes);
+    }
+    delete_queue(queue);
     
     return EXIT_SUCCESS;
 }
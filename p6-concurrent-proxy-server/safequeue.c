@@ -29,7 +29,7 @@ priority_queue* create_queue(int queue_size) {
 }
 
 // Function to add a new request into the priority queue
-int add_work(priority_queue* queue, int client_fd, int priority, int delay, char* path) {
+int add_work(priority_queue* queue, int client_fd, int priority, int delay, char* path, struct timespec accepted) {
     pthread_mutex_lock(&queue->mutex);
 
     if (queue->curr_size == queue->max_size) {
@@ -42,6 +42,7 @@ int add_work(priority_queue* queue, int client_fd, int priority, int delay, char
     queue->requests[queue->curr_size].priority = priority;
     queue->requests[queue->curr_size].delay = delay;
     queue->requests[queue->curr_size].path = path;
+    queue->requests[queue->curr_size].accepted = accepted;
     queue->curr_size++;
 
     pthread_cond_signal(&queue->cond);
@@ -105,6 +106,7 @@ queue_request get_work(priority_queue* queue) {
     next_request.delay = queue->requests[index].delay;
     next_request.path = malloc(1000);
     next_request.path = queue->requests[index].path;
+    next_request.accepted = queue->requests[index].accepted;
 
     for (int i = index; i < queue->curr_size; i++) {
         queue->requests[i] = queue->requests[i+1];
@@ -149,6 +151,7 @@ queue_request get_work_nonblocking(priority_queue* queue) {
     next_request.delay = queue->requests[index].delay;
     next_request.path = malloc(1000);
     next_request.path = queue->requests[index].path;
+    next_request.accepted = queue->requests[index].accepted;
 
     for (int i = index; i < queue->curr_size; i++) {
         queue->requests[i] = queue->requests[i+1];
@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <time.h>
 #ifndef SAFEQUEUE_H
 #define SAFEQUEUE_H
 
@@ -9,6 +10,7 @@ typedef struct {
     int priority; // Store the priority of the request
     int delay; // Store the value of delay header sent with the request
     char *path; // Store the path of the request
+    struct timespec accepted; // Time at which the listener accepted the connection
 } queue_request;
 
 typedef struct {
@@ -20,7 +22,7 @@ typedef struct {
 } priority_queue;
 
 priority_queue* create_queue(int queue_size);
-int add_work(priority_queue* queue, int client_fd, int priority, int delay, char* path);
+int add_work(priority_queue* queue, int client_fd, int priority, int delay, char* path, struct timespec accepted);
 int peek(priority_queue* queue);
 queue_request get_work(priority_queue* queue);
 queue_request get_work_nonblocking(priority_queue* queue);
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include "spscring.h"
+
+// Hint to the CPU that we are busy waiting
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Function to create an empty single-producer/single-consumer ring holding up to ring_size requests
+spsc_ring* create_ring(int ring_size) {
+    spsc_ring* ring;
+    if (posix_memalign((void**)&ring, CACHE_LINE_SIZE, sizeof(spsc_ring)) != 0) {
+        perror("Failed to allocate memory for the ring");
+        exit(1);
+    }
+
+    // Round the slots up to a power of two so that indexes wrap with a mask
+    unsigned long num_slots = 1;
+    while (num_slots < ring_size) {
+        num_slots *= 2;
+    }
+    if (posix_memalign((void**)&ring->requests, CACHE_LINE_SIZE, num_slots * sizeof(ring_request)) != 0) {
+        perror("Failed to allocate memory for the ring");
+        exit(1);
+    }
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->max_size = ring_size;
+    ring->mask = num_slots - 1;
+    memset(ring->requests, 0, num_slots * sizeof(ring_request));
+
+    return ring;
+}
+
+// Function to add a new request into the ring, only ever called by the listener owning the ring
+int ring_push(spsc_ring* ring, int client_fd, int delay, char* path, struct timespec accepted) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == ring->max_size) {
+        return -1;
+    }
+
+    ring_request* slot = &ring->requests[head & ring->mask];
+    slot->client_fd = client_fd;
+    slot->delay = delay;
+    slot->path = path;
+    slot->accepted = accepted;
+
+    // Publish the slot to the consumer
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Function to remove the oldest request from the ring, only ever called by the worker owning the ring
+int ring_pop(spsc_ring* ring, ring_request* request) {
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head) {
+        return -1;
+    }
+
+    *request = ring->requests[tail & ring->mask];
+
+    // Hand the slot back to the producer
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Function to delete the ring
+void delete_ring(spsc_ring* ring) {
+    free(ring->requests);
+    free(ring);
+}
+
+// Function to create the inbox of a worker with one ring per listener, each holding up to ring_size requests
+worker_inbox* create_inbox(int num_rings, int ring_size) {
+    worker_inbox* inbox = (worker_inbox*)malloc(sizeof(worker_inbox));
+    if (inbox == NULL) {
+        perror("Failed to allocate memory for the inbox");
+        exit(1);
+    }
+
+    inbox->rings = (spsc_ring**)malloc(num_rings * sizeof(spsc_ring*));
+    if (inbox->rings == NULL) {
+        perror("Failed to allocate memory for the inbox");
+        exit(1);
+    }
+    for(int i = 0; i < num_rings; i++) {
+        inbox->rings[i] = create_ring(ring_size);
+    }
+    inbox->num_rings = num_rings;
+    inbox->next_ring = 0;
+    inbox->spin_count = MIN_SPIN_COUNT;
+    inbox->sleeping = 0;
+    pthread_mutex_init(&inbox->mutex, NULL);
+    pthread_cond_init(&inbox->cond, NULL);
+
+    return inbox;
+}
+
+// Helper function to take a request from any ring of the inbox, starting after the last ring served
+static int inbox_poll(worker_inbox* inbox, ring_request* request) {
+    for(int i = 0; i < inbox->num_rings; i++) {
+        int index = (inbox->next_ring + i) % inbox->num_rings;
+        if(ring_pop(inbox->rings[index], request) == 0) {
+            inbox->next_ring = (index + 1) % inbox->num_rings;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Function called by a listener after pushing into one of the inbox rings to wake the worker if it is blocked
+void inbox_notify(worker_inbox* inbox) {
+    // Order the push before reading the sleeping flag, pairs with the fence in inbox_get_work
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&inbox->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&inbox->mutex);
+        pthread_cond_signal(&inbox->cond);
+        pthread_mutex_unlock(&inbox->mutex);
+    }
+}
+
+// Function to take the next request from the inbox, spinning for a while before blocking
+ring_request inbox_get_work(worker_inbox* inbox) {
+    ring_request next_request;
+
+    // Spin with an adaptive budget: grow it when spinning pays off and shrink it when we end up blocking anyway
+    for(int spins = 0; spins <= inbox->spin_count; spins++) {
+        if(inbox_poll(inbox, &next_request) == 0) {
+            if(spins > 0 && inbox->spin_count < MAX_SPIN_COUNT) {
+                inbox->spin_count *= 2;
+            }
+            return next_request;
+        }
+        cpu_relax();
+    }
+    if(inbox->spin_count > MIN_SPIN_COUNT) {
+        inbox->spin_count /= 2;
+    }
+
+    pthread_mutex_lock(&inbox->mutex);
+    __atomic_store_n(&inbox->sleeping, 1, __ATOMIC_RELAXED);
+    // Order setting the sleeping flag before polling, pairs with the fence in inbox_notify
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while(inbox_poll(inbox, &next_request) == -1) {
+        pthread_cond_wait(&inbox->cond, &inbox->mutex);
+    }
+    __atomic_store_n(&inbox->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&inbox->mutex);
+
+    return next_request;
+}
+
+// Function to delete the inbox and its rings
+void delete_inbox(worker_inbox* inbox) {
+    for(int i = 0; i < inbox->num_rings; i++) {
+        delete_ring(inbox->rings[i]);
+    }
+    free(inbox->rings);
+    pthread_mutex_destroy(&inbox->mutex);
+    pthread_cond_destroy(&inbox->cond);
+    free(inbox);
+}
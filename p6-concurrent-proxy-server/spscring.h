@@ -0,0 +1,47 @@
+#include <pthread.h>
+#include <time.h>
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#define CACHE_LINE_SIZE 64
+#define MIN_SPIN_COUNT 16
+#define MAX_SPIN_COUNT 16384
+
+typedef struct {
+    int client_fd; // Store the client FD
+    int delay; // Store the value of delay header sent with the request
+    char *path; // Store the path of the request
+    struct timespec accepted; // Time at which the listener accepted the connection
+} ring_request;
+
+// Single-producer/single-consumer ring written by exactly one listener and drained by exactly one worker
+typedef struct {
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE))); // Next slot the producer writes
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE))); // Next slot the consumer reads
+    unsigned long max_size __attribute__((aligned(CACHE_LINE_SIZE))); // Most requests the ring holds at once
+    unsigned long mask; // Number of slots minus one, the number of slots is a power of two of at least max_size
+    ring_request *requests;
+} spsc_ring;
+
+// Set of rings owned by a worker, one per listener, plus the state needed to block when all are empty
+typedef struct {
+    spsc_ring **rings;
+    int num_rings;
+    int next_ring; // Ring to poll first so that one busy listener can't starve the others
+    int spin_count; // Current adaptive spin budget before blocking
+    int sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} worker_inbox;
+
+spsc_ring* create_ring(int ring_size);
+int ring_push(spsc_ring* ring, int client_fd, int delay, char* path, struct timespec accepted);
+int ring_pop(spsc_ring* ring, ring_request* request);
+void delete_ring(spsc_ring* ring);
+
+worker_inbox* create_inbox(int num_rings, int ring_size);
+void inbox_notify(worker_inbox* inbox);
+ring_request inbox_get_work(worker_inbox* inbox);
+void delete_inbox(worker_inbox* inbox);
+
+#endif
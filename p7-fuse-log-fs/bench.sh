@@ -0,0 +1,53 @@
+#!/bin/bash
+# Formats a fresh disk image, mounts it, runs wfsbench on it and times fsck.wfs on the image once it is unmounted.
+# Results are printed as CSV. Usage: ./bench.sh [disk_size] [mount.wfs -o options] [wfsbench arguments...]
+set -euo pipefail
+cd "$(dirname "$0")"
+
+disk_size=${1:-1M}
+mount_options=${2:-}
+shift $(( $# > 2 ? 2 : $# ))
+
+disk=bench_disk
+mnt=bench_mnt
+mount_pid=
+
+cleanup() {
+    fusermount -u "$mnt" 2>/dev/null || true
+    if [ -n "$mount_pid" ]; then
+        kill "$mount_pid" 2>/dev/null || true
+        wait "$mount_pid" 2>/dev/null || true
+    fi
+    rm -rf "$disk" "$mnt"
+}
+trap cleanup EXIT
+
+rm -f "$disk"
+truncate -s "$disk_size" "$disk"
+./mkfs.wfs "$disk"
+mkdir -p "$mnt"
+
+# direct_io makes reads reach mount.wfs instead of being served from the page cache
+./mount.wfs -f -o direct_io${mount_options:+,$mount_options} "$disk" "$mnt" &
+mount_pid=$!
+for _ in $(seq 50); do
+    mountpoint -q "$mnt" && break
+    if ! kill -0 "$mount_pid" 2>/dev/null; then
+        echo "mount.wfs exited before mounting $mnt" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+if ! mountpoint -q "$mnt"; then
+    echo "$mnt is not mounted after 5 seconds" >&2
+    exit 1
+fi
+
+./wfsbench "$mnt" "$@"
+
+fusermount -u "$mnt"
+wait "$mount_pid"
+mount_pid=
+
+# fsck.wfs reports how long compaction took, e.g. "Compacted log from 1024 to 512 bytes, reclaimed 512 bytes in 0.1 ms"
+./fsck.wfs "$disk" | sed -n 's/^Compacted log from \([0-9]*\) to .* in \([0-9.]*\) ms$/fsck,\1,\2,ms/p'
@@ -7,29 +7,134 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <pthread.h>
+
+#define WFS_UPGRADE_MIN_VERSION 0   // oldest version that can be upgraded, version 0 images have no version field
+#define WFS_WIDE_MIN_VERSION 3      // oldest version with 64-bit offsets and sizes and aligned log entries
+#define WFS_V6_INODE_SIZE 48        // size of struct wfs_inode before log entries were checksummed
+#define WFS_V7_VERSION 7            // last version whose superblock didn't hold the alignment of the log
+#define WFS_V8_VERSION 8            // last version whose checksums lost the upper half of the last word hashed
+#define VERIFY_MIN_RANGE (1024 * 1024) // smallest part of the log worth verifying on a thread of its own
+
+// Layout of the superblock of version 0, the original format, whose log starts right after the head. Its log entries
+// are those of version 2 without extents or directory entry updates
+struct wfs_sb_v0 {
+    uint32_t magic;
+    uint32_t head;
+};
+
+// Layout of the superblock, inode and extent of versions before WFS_WIDE_MIN_VERSION, which had 32-bit offsets and
+// sizes and unaligned log entries. Directory entries and directory entry updates are unchanged
+struct wfs_sb_v2 {
+    uint32_t magic;
+    uint32_t head;
+    uint32_t version;
+    uint32_t checkpoint;
+};
+
+struct wfs_inode_v2 {
+    unsigned int inode_number;
+    unsigned int deleted;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned int flags;
+    unsigned int size;
+    unsigned int atime;
+    unsigned int mtime;
+    unsigned int ctime;
+    unsigned int links;
+};
+
+struct wfs_extent_v2 {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// Layout of the superblock from WFS_WIDE_MIN_VERSION up to WFS_V7_VERSION, before the alignment was added
+struct wfs_sb_v7 {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t head;
+    uint64_t checkpoint;
+};
+
+// State of an inode gathered by the forward pass over the log
+struct inode_state {
+    off_t latest;                           // offset of the most recent log entry (-1 if it has none)
+    off_t base;                             // offset of the most recent log entry holding the whole file
+    int has_extents;                        // 1 if extent or directory entry update log entries were appended after base
+    off_t live_bytes;                       // bytes taken up by base and the extents appended after it
+    size_t peak_size;                       // largest size of a directory since base
+    int consolidate;                        // 1 if folding the extents into base takes up less space
+    int encoded;                            // 1 if base or the extents after it reference chunks or are compressed
+    int referenced;                         // 1 if a chunk is referenced by a live log entry
+    struct wfs_log_entry *consolidated;     // whole-file entry being rebuilt from base and its extents
+    off_t gathered_bytes;                   // bytes taken up by the entries gathered into consolidated so far
+};
+
+// Part of the log verified by one thread. The thread starts at the first offset within the range that holds a valid log
+// entry and follows entries from there, which only counts if the entries before the range lead to the same offset
+struct verify_range {
+    off_t start;
+    off_t end;
+    off_t first;                            // offset of the first valid log entry found in the range, -1 if none
+    off_t chain_end;                        // offset the entries followed from first lead to, at or past end
+    off_t torn;                             // offset of the first invalid entry reached from first, -1 if none
+};
 
 // Global variables for storing info related to the disk file and its memory mapping
 int fd;
 void* mapped_data;
-void* new_mapped_data;
-int disk_size;
+off_t disk_size;
+
+// Global array of inode states indexed by inode number
+struct inode_state* inode_states;
+int inode_states_capacity;
+
+// Position of every inode within the consolidated entry of the directory it belongs to, indexed by inode number
+int* dentry_positions;
+int dentry_positions_capacity;
 
 // Helper function to print all entries of the log structured filesystem
 void print_log_entries() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-    off_t current_offset = sizeof(struct wfs_sb);
+    off_t current_offset = wfs_log_start(sb);
     while (current_offset < sb->head) {
         struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
+        size_t entry_size = wfs_valid_log_entry_size(mapped_data, current_offset, sb->head);
+        if(entry_size == 0) {
+            printf("Torn log entry at offset %ld\n", (long)current_offset);
+            break;
+        }
 
         if(log_entry->inode.deleted == 1) {
-            current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+            current_offset += entry_size;
             continue;
         }
 
-        printf("Inode Number: %u, Mode: %u, Size: %u\n", log_entry->inode.inode_number, log_entry->inode.mode, log_entry->inode.size);
-
-        if (S_ISDIR(log_entry->inode.mode)) {
+        printf("Inode Number: %u, Mode: %u, Size: %lu\n", log_entry->inode.inode_number, log_entry->inode.mode, log_entry->inode.size);
+
+        if (log_entry->inode.flags & WFS_INODE_TOMBSTONE) {
+            printf("This is a tombstone\n");
+        } else if (log_entry->inode.flags & WFS_INODE_CHUNKED) {
+            struct wfs_chunk_list *list = (struct wfs_chunk_list *)log_entry->data;
+            printf("This is a chunked file %s (Offset: %lu, Length: %lu, Chunks: %lu)\n", log_entry->inode.flags & WFS_INODE_EXTENT ? "extent" : "entry",
+                   list->offset, list->length, list->num_chunks);
+        } else if (log_entry->inode.flags & WFS_INODE_CHUNK) {
+            printf("This is a chunk of file data\n");
+        } else if (log_entry->inode.flags & WFS_INODE_EXTENT) {
+            struct wfs_extent *extent = (struct wfs_extent *)log_entry->data;
+            printf("This is a file extent (Offset: %lu, Length: %lu)\n", extent->offset, extent->length);
+        } else if (log_entry->inode.flags & WFS_INODE_DENTRY) {
+            struct wfs_dentry_update *update = (struct wfs_dentry_update *)log_entry->data;
+            if(update->op == WFS_DENTRY_NONE) {
+                printf("This is a directory inode update\n");
+            } else {
+                printf("  %s: %s (Inode: %lu)\n", update->op == WFS_DENTRY_ADD ? "Added" : "Removed", update->dentry.name, update->dentry.inode_number);
+            }
+        } else if (S_ISDIR(log_entry->inode.mode)) {
             struct wfs_dentry *entries = (struct wfs_dentry *)log_entry->data;
             int num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
 
@@ -40,96 +145,579 @@ void print_log_entries() {
             printf("This is a file\n");
         }
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+        current_offset += entry_size;
+    }
+}
+
+// Helper function to grow the per-inode state so that it covers an inode number
+void grow_inode_states(unsigned int inode_number) {
+    if(inode_number < inode_states_capacity) {
+        return;
+    }
+
+    int old_capacity = inode_states_capacity;
+    int new_capacity = inode_states_capacity > 0 ? inode_states_capacity : 64;
+    while(new_capacity <= inode_number) {
+        new_capacity *= 2;
     }
+    inode_states = realloc(inode_states, new_capacity * sizeof(struct inode_state));
+    if(inode_states == NULL) {
+        perror("Error allocating inode states");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = old_capacity; i < new_capacity; i++) {
+        inode_states[i].latest = -1;
+        inode_states[i].base = -1;
+        inode_states[i].has_extents = 0;
+        inode_states[i].live_bytes = 0;
+        inode_states[i].peak_size = 0;
+        inode_states[i].consolidate = 0;
+        inode_states[i].encoded = 0;
+        inode_states[i].referenced = 0;
+        inode_states[i].consolidated = NULL;
+        inode_states[i].gathered_bytes = 0;
+    }
+    inode_states_capacity = new_capacity;
 }
 
-// Helper function to find the most recent log entry for an inode number
-struct wfs_log_entry* find_latest_log_entry(unsigned int inode_number) {
+// Helper function to record the most recent log entries of every inode with a single forward pass over the log
+void scan_log() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    struct wfs_log_entry* latest_entry = NULL;
 
-    off_t current_offset = sizeof(struct wfs_sb);
+    off_t current_offset = wfs_log_start(sb);
     while (current_offset < sb->head) {
         struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
 
-        if(log_entry->inode.inode_number == inode_number && log_entry->inode.deleted == 0) {
-            latest_entry = log_entry;
+        if(log_entry->inode.deleted == 0) {
+            grow_inode_states(log_entry->inode.inode_number);
+            struct inode_state *state = &inode_states[log_entry->inode.inode_number];
+            state->latest = current_offset;
+            if(log_entry->inode.flags & WFS_INODE_TOMBSTONE) {
+                // Nothing written before a tombstone is live, and the tombstone goes away with it
+                state->latest = -1;
+                state->base = -1;
+                state->has_extents = 0;
+                state->live_bytes = 0;
+                state->peak_size = 0;
+                state->encoded = 0;
+            }
+            else if(log_entry->inode.flags & (WFS_INODE_EXTENT | WFS_INODE_DENTRY)) {
+                state->has_extents = 1;
+                state->live_bytes += wfs_log_entry_size(log_entry, sb);
+            }
+            else {
+                state->base = current_offset;
+                state->has_extents = 0;
+                state->live_bytes = wfs_log_entry_size(log_entry, sb);
+                state->peak_size = 0;
+                state->encoded = 0;
+            }
+            if(log_entry->inode.flags & (WFS_INODE_CHUNKED | WFS_INODE_COMPRESSED)) {
+                state->encoded = 1;
+            }
+            if(log_entry->inode.size > state->peak_size) {
+                state->peak_size = log_entry->inode.size;
+            }
+        }
+
+        current_offset += wfs_log_entry_size(log_entry, sb);
+    }
+
+    // Fold extents into a whole-file entry unless holes in the file would make it bigger than the entries it replaces.
+    // Files referencing chunks or holding compressed data are left as they are, the cleaner of mount.wfs folds those
+    for(int i = 0; i < inode_states_capacity; i++) {
+        struct inode_state *state = &inode_states[i];
+        if(state->has_extents && !state->encoded) {
+            struct wfs_log_entry *latest = (struct wfs_log_entry *)((char *)mapped_data + state->latest);
+            size_t consolidated_size = S_ISDIR(latest->inode.mode) ? wfs_entry_size(sb, 0, sizeof(struct wfs_log_entry) + latest->inode.size) :
+                                                                     wfs_entry_size(sb, sizeof(struct wfs_log_entry), latest->inode.size);
+            state->consolidate = consolidated_size <= state->live_bytes;
+        }
+    }
+}
+
+// Helper function to check if a log entry is needed to rebuild the most recent state of its inode
+int is_live_log_entry(struct wfs_log_entry *log_entry, off_t offset) {
+    if(log_entry->inode.deleted == 1 || (log_entry->inode.flags & WFS_INODE_TOMBSTONE)) {
+        return 0;
+    }
+    struct inode_state *state = &inode_states[log_entry->inode.inode_number];
+    if(log_entry->inode.flags & WFS_INODE_CHUNK) {
+        return offset == state->base && state->referenced;
+    }
+    if(state->has_extents) {
+        return offset >= state->base;
+    }
+    return offset == state->base;
+}
+
+// Helper function to record where an inode sits within the consolidated entry of its directory
+void set_dentry_position(unsigned long inode_number, int position) {
+    if(inode_number >= dentry_positions_capacity) {
+        int new_capacity = dentry_positions_capacity > 0 ? dentry_positions_capacity : 64;
+        while(new_capacity <= inode_number) {
+            new_capacity *= 2;
+        }
+        dentry_positions = realloc(dentry_positions, new_capacity * sizeof(int));
+        if(dentry_positions == NULL) {
+            perror("Error allocating directory entry positions");
+            exit(EXIT_FAILURE);
+        }
+        dentry_positions_capacity = new_capacity;
+    }
+    dentry_positions[inode_number] = position;
+}
+
+// Helper function to fold a live log entry of a directory into its consolidated entries. Entry updates are applied the
+// same way mount.wfs applies them, so the order of the entries matches what it would write
+void consolidate_dir_log_entry(struct wfs_log_entry *log_entry) {
+    struct inode_state *state = &inode_states[log_entry->inode.inode_number];
+
+    // The directory may have been larger in between than it is now
+    if(state->consolidated == NULL) {
+        state->consolidated = calloc(1, wfs_entry_size(mapped_data, 0, sizeof(struct wfs_log_entry) + state->peak_size));
+        if(state->consolidated == NULL) {
+            perror("Error allocating consolidated log entry");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct wfs_dentry *entries = (struct wfs_dentry *)state->consolidated->data;
+    int num_entries = state->consolidated->inode.size / sizeof(struct wfs_dentry);
+    if(!(log_entry->inode.flags & WFS_INODE_DENTRY)) {
+        num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
+        memcpy(entries, log_entry->data, log_entry->inode.size);
+        for(int i = 0; i < num_entries; i++) {
+            set_dentry_position(entries[i].inode_number, i);
+        }
+    }
+    else {
+        struct wfs_dentry_update *update = (struct wfs_dentry_update *)log_entry->data;
+        if(update->op == WFS_DENTRY_ADD) {
+            memcpy(&entries[num_entries], &update->dentry, sizeof(struct wfs_dentry));
+            set_dentry_position(update->dentry.inode_number, num_entries);
+            num_entries++;
+        }
+        else if(update->op == WFS_DENTRY_REMOVE && update->dentry.inode_number < dentry_positions_capacity) {
+            // A renamed inode sits under both names for a moment, so make sure the position is that of the removed name
+            int position = dentry_positions[update->dentry.inode_number];
+            if(position >= num_entries || entries[position].inode_number != update->dentry.inode_number ||
+               strcmp(entries[position].name, update->dentry.name) != 0) {
+                for(position = 0; position < num_entries; position++) {
+                    if(entries[position].inode_number == update->dentry.inode_number &&
+                       strcmp(entries[position].name, update->dentry.name) == 0) {
+                        break;
+                    }
+                }
+            }
+
+            // Move the last entry into the place of the removed one
+            if(position < num_entries) {
+                num_entries--;
+                if(position != num_entries) {
+                    memcpy(&entries[position], &entries[num_entries], sizeof(struct wfs_dentry));
+                    set_dentry_position(entries[position].inode_number, position);
+                }
+            }
+        }
+    }
+
+    memcpy(&state->consolidated->inode, &log_entry->inode, sizeof(struct wfs_inode));
+    state->consolidated->inode.flags &= ~WFS_INODE_DENTRY;
+    state->consolidated->inode.size = num_entries * sizeof(struct wfs_dentry);
+}
+
+// Helper function to fold a live log entry of a file written in extents into its consolidated contents
+void consolidate_log_entry(struct wfs_log_entry *log_entry) {
+    struct inode_state *state = &inode_states[log_entry->inode.inode_number];
+    struct wfs_log_entry *latest = (struct wfs_log_entry *)((char *)mapped_data + state->latest);
+
+    if(S_ISDIR(log_entry->inode.mode)) {
+        consolidate_dir_log_entry(log_entry);
+        return;
+    }
+
+    // Size the consolidated entry after the most recent state of the file
+    if(state->consolidated == NULL) {
+        state->consolidated = calloc(1, wfs_entry_size(mapped_data, sizeof(struct wfs_log_entry), latest->inode.size));
+        if(state->consolidated == NULL) {
+            perror("Error allocating consolidated log entry");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Only bytes within the most recent size of the file are part of it
+    if(log_entry->inode.flags & WFS_INODE_EXTENT) {
+        struct wfs_extent *extent = (struct wfs_extent *)log_entry->data;
+        if(extent->offset < latest->inode.size) {
+            size_t length = latest->inode.size - extent->offset < extent->length ? latest->inode.size - extent->offset : extent->length;
+            memcpy(state->consolidated->data + extent->offset, extent->data, length);
+        }
+    }
+    else {
+        size_t length = latest->inode.size < log_entry->inode.size ? latest->inode.size : log_entry->inode.size;
+        memcpy(state->consolidated->data, log_entry->data, length);
+    }
+
+    // Bytes past the size of the file at this entry were cut off by a truncate and read as zeros if it grows again
+    if(log_entry->inode.size < latest->inode.size) {
+        memset(state->consolidated->data + log_entry->inode.size, 0, latest->inode.size - log_entry->inode.size);
+    }
+    memcpy(&state->consolidated->inode, &log_entry->inode, sizeof(struct wfs_inode));
+    state->consolidated->inode.flags &= ~WFS_INODE_EXTENT;
+}
+
+// Helper function to find the size of the data following the header of a log entry of an older version
+size_t old_payload_size(const struct wfs_inode_v2 *inode, const char *data) {
+    if(inode->flags & WFS_INODE_EXTENT) {
+        struct wfs_extent_v2 extent;
+        memcpy(&extent, data, sizeof(struct wfs_extent_v2));
+        return sizeof(struct wfs_extent_v2) + extent.length;
+    }
+    if(inode->flags & WFS_INODE_DENTRY) {
+        return sizeof(struct wfs_dentry_update);
+    }
+    return inode->size;
+}
+
+// Helper function to convert a log entry of an older version to the current format, returns the size of the new entry.
+// Only measures the new entry if new_entry is NULL
+size_t upgrade_log_entry(const struct wfs_inode_v2 *inode, const char *data, struct wfs_log_entry *new_entry) {
+    size_t payload_size = inode->size;
+    struct wfs_extent_v2 extent;
+    if(inode->flags & WFS_INODE_EXTENT) {
+        memcpy(&extent, data, sizeof(struct wfs_extent_v2));
+        payload_size = sizeof(struct wfs_extent) + extent.length;
+    }
+    else if(inode->flags & WFS_INODE_DENTRY) {
+        payload_size = sizeof(struct wfs_dentry_update);
+    }
+    if(new_entry == NULL) {
+        return wfs_align(sizeof(struct wfs_log_entry) + payload_size, WFS_ALIGNMENT);
+    }
+
+    memset(&new_entry->inode, 0, sizeof(struct wfs_inode));
+    new_entry->inode.inode_number = inode->inode_number;
+    new_entry->inode.deleted = inode->deleted;
+    new_entry->inode.mode = inode->mode;
+    new_entry->inode.uid = inode->uid;
+    new_entry->inode.gid = inode->gid;
+    new_entry->inode.flags = inode->flags;
+    new_entry->inode.size = inode->size;
+    new_entry->inode.atime = inode->atime;
+    new_entry->inode.mtime = inode->mtime;
+    new_entry->inode.ctime = inode->ctime;
+    new_entry->inode.links = inode->links;
+    if(inode->flags & WFS_INODE_EXTENT) {
+        struct wfs_extent *new_extent = (struct wfs_extent *)new_entry->data;
+        new_extent->offset = extent.offset;
+        new_extent->length = extent.length;
+        memcpy(new_extent->data, data + sizeof(struct wfs_extent_v2), extent.length);
+    }
+    else {
+        memcpy(new_entry->data, data, payload_size);
+    }
+    new_entry->inode.checksum = wfs_checksum(new_entry);
+    return wfs_align(sizeof(struct wfs_log_entry) + payload_size, WFS_ALIGNMENT);
+}
+
+// Helper function to convert a log entry of a version from WFS_WIDE_MIN_VERSION on, whose header of inode_size bytes is
+// the start of the current one, to the current format. Returns the size of the new entry and sets old_size to that of
+// the old one. Only measures the new entry if new_entry is NULL
+size_t upgrade_wide_log_entry(const char *old_entry, size_t inode_size, size_t *old_size, struct wfs_log_entry *new_entry) {
+    struct wfs_inode inode;
+    memset(&inode, 0, sizeof(struct wfs_inode));
+    memcpy(&inode, old_entry, inode_size);
+    const char *data = old_entry + inode_size;
+    size_t payload_size = wfs_payload_size(&inode, data);
+    *old_size = wfs_align(inode_size + payload_size, WFS_ALIGNMENT);
+    if(new_entry == NULL) {
+        return wfs_align(sizeof(struct wfs_log_entry) + payload_size, WFS_ALIGNMENT);
+    }
+
+    memcpy(&new_entry->inode, &inode, sizeof(struct wfs_inode));
+    memcpy(new_entry->data, data, payload_size);
+    new_entry->inode.checksum = wfs_checksum(new_entry);
+    return wfs_align(sizeof(struct wfs_log_entry) + payload_size, WFS_ALIGNMENT);
+}
+
+// Helper function to convert the log entry of an older version at old_entry to the current format, returns the size of
+// the new entry or 0 if the entry is deleted and dropped. Sets old_size to the size of the old entry, and only measures
+// the new entry if new_entry is NULL
+size_t upgrade_old_log_entry(const char *old_entry, int version, size_t *old_size, struct wfs_log_entry *new_entry) {
+    // Both layouts start with the inode number and deleted
+    struct wfs_inode_v2 inode;
+    memcpy(&inode, old_entry, sizeof(struct wfs_inode_v2));
+    if(version >= WFS_WIDE_MIN_VERSION) {
+        size_t inode_size = version >= WFS_V7_VERSION ? sizeof(struct wfs_inode) : WFS_V6_INODE_SIZE;
+        size_t new_size = upgrade_wide_log_entry(old_entry, inode_size, old_size, inode.deleted == 0 ? new_entry : NULL);
+        return inode.deleted == 0 ? new_size : 0;
+    }
+
+    const char *data = old_entry + sizeof(struct wfs_inode_v2);
+    *old_size = sizeof(struct wfs_inode_v2) + old_payload_size(&inode, data);
+    return inode.deleted == 0 ? upgrade_log_entry(&inode, data, new_entry) : 0;
+}
+
+// Helper function to rewrite an image of an older version in the current format, with the default alignment. Dead
+// entries are dropped on the way, the rest of the compaction is left to the usual pass
+void upgrade_image(int version) {
+    struct wfs_sb_v2 *old_sb = (struct wfs_sb_v2 *)mapped_data;
+    int wide = version >= WFS_WIDE_MIN_VERSION;
+    size_t old_head = wide ? ((struct wfs_sb_v7 *)mapped_data)->head : old_sb->head;
+    off_t old_start = wide ? sizeof(struct wfs_sb_v7) : version == 0 ? sizeof(struct wfs_sb_v0) : sizeof(struct wfs_sb_v2);
+    char *old_log = malloc(old_head);
+    if(old_log == NULL) {
+        perror("Error allocating memory for the old log");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(old_log, mapped_data, old_head);
+
+    // Entries grow with their wider fields and alignment, so make sure the new log fits first
+    off_t new_head = sizeof(struct wfs_sb);
+    off_t current_offset = old_start;
+    while(current_offset < old_head) {
+        size_t old_size;
+        new_head += upgrade_old_log_entry(old_log + current_offset, version, &old_size, NULL);
+        current_offset += old_size;
+    }
+    if(new_head > disk_size) {
+        if(ftruncate(fd, new_head) == -1) {
+            perror("Error growing disk image");
+            exit(EXIT_FAILURE);
+        }
+        munmap(mapped_data, disk_size);
+        disk_size = new_head;
+        mapped_data = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped_data == MAP_FAILED) {
+            perror("Error mapping disk file into memory");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+    off_t write_offset = sizeof(struct wfs_sb);
+    current_offset = old_start;
+    while(current_offset < old_head) {
+        size_t old_size;
+        write_offset += upgrade_old_log_entry(old_log + current_offset, version, &old_size,
+                                              (struct wfs_log_entry *)((char *)mapped_data + write_offset));
+        current_offset += old_size;
+    }
+    if(write_offset < old_head) {
+        memset((char *)mapped_data + write_offset, 0, old_head - write_offset);
     }
-    return latest_entry;
+
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    sb->magic = WFS_MAGIC;
+    sb->version = WFS_VERSION;
+    sb->head = write_offset;
+    sb->checkpoint = 0;
+    sb->alignment = WFS_ALIGNMENT;
+    sb->data_alignment = 0;
+    free(old_log);
 }
 
-// Helper function to find the most recent log entry for a given path
-struct wfs_log_entry* find_log_entry_by_path(const char *path) {
+// Helper function to compute the checksum of a log entry the way version WFS_V8_VERSION did, whose fold of the hash
+// cancelled out the upper half of the last word hashed
+uint32_t v8_checksum(const struct wfs_log_entry *log_entry) {
+    uint64_t hash = wfs_entry_hash(log_entry);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Helper function to upgrade an image of version WFS_V8_VERSION in place, whose log entries only differ from the
+// current ones in their checksum. Entries that don't match their old checksum are left for verify_log to drop, and the
+// walk picks up again at the next aligned offset holding an entry that matches it
+void reseal_log() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    struct wfs_log_entry *found_entry = NULL;
-    off_t current_offset = sizeof(struct wfs_sb);
-    struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + sizeof(struct wfs_sb));
 
-    char *token, *saveptr;
-    char path_copy[MAX_PATH_NAME_LEN];
-    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
+    off_t offset = wfs_log_start(sb);
+    while(offset < sb->head) {
+        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + offset);
+        size_t entry_size = wfs_plausible_log_entry_size(mapped_data, offset, sb->head);
+        if(entry_size == 0 || log_entry->inode.checksum != v8_checksum(log_entry)) {
+            offset += WFS_ALIGNMENT;
+            continue;
+        }
+        log_entry->inode.checksum = wfs_checksum(log_entry);
+        offset += entry_size;
+    }
+    sb->version = WFS_VERSION;
+}
+
+// Helper function to mark the dead space between two offsets as a deleted log entry so that log scans skip over it
+void write_padding(off_t start_offset, off_t end_offset) {
+    struct wfs_log_entry *padding = (struct wfs_log_entry *)((char*)mapped_data + start_offset);
+    memset(&padding->inode, 0, sizeof(struct wfs_inode));
+    padding->inode.deleted = 1;
+    padding->inode.flags = WFS_INODE_PADDING;
+    padding->inode.size = end_offset - start_offset - sizeof(struct wfs_log_entry);
+    padding->inode.checksum = wfs_checksum(padding);
+}
 
-    token = strtok_r(path_copy, "/", &saveptr);
+// Helper function to follow valid log entries from offset until reaching the end of a range, recording where they lead
+// and the first invalid one
+void walk_log_entries(off_t offset, struct verify_range *range) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-    if(token == NULL) {
-        int inode_number = log_entry->inode.inode_number;
-        return find_latest_log_entry(inode_number);
+    range->first = offset;
+    range->torn = -1;
+    while(offset < range->end) {
+        size_t entry_size = wfs_valid_log_entry_size(mapped_data, offset, sb->head);
+        if(entry_size == 0) {
+            range->torn = offset;
+            break;
+        }
+        offset += entry_size;
     }
+    range->chain_end = offset;
+}
 
-    while (token != NULL && current_offset < sb->head) {
-        log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
+// Helper function run by the verifier threads to find the first log entry boundary within a range and check the entries
+// from there on
+void *verify_range_thread(void *arg) {
+    struct verify_range *range = (struct verify_range *)arg;
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-        if (S_ISDIR(log_entry->inode.mode)) {
-            struct wfs_dentry *entries = (struct wfs_dentry *)log_entry->data;
-            int num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
+    // Entries start at aligned offsets, so probe those until one holds an entry matching its checksum. Checking the
+    // checksum of a well formed header costs as much as the entry it claims, so the bytes checked are capped at the size
+    // of the range. A range running out of it is walked while stitching, from where the entries before it lead
+    off_t budget = range->end - range->start;
+    for(off_t offset = range->start; offset < range->end; offset += WFS_ALIGNMENT) {
+        size_t entry_size = wfs_plausible_log_entry_size(mapped_data, offset, sb->head);
+        if(entry_size == 0) {
+            continue;
+        }
+        if(entry_size > budget) {
+            break;
+        }
+        budget -= entry_size;
+        if(wfs_valid_log_entry_size(mapped_data, offset, sb->head) != 0) {
+            walk_log_entries(offset, range);
+            return NULL;
+        }
+    }
+    range->first = -1;
+    return NULL;
+}
 
-            int i;
-            int flag = 0;
-            for (i = 0; i < num_entries; ++i) {
-                if (strcmp(entries[i].name, token) == 0) {
-                    struct wfs_log_entry *temp = find_latest_log_entry(entries[i].inode_number);
-                    if(temp == NULL) {
-                        continue;
-                    }
-                    log_entry = temp;
-                    current_offset = (char*)log_entry - (char*)mapped_data;
-                    token = strtok_r(NULL, "/", &saveptr);
-                    flag = 1;
-                    break;
-                }
+// Helper function to find the first offset past a log entry that failed its checksum where a valid entry starts again,
+// -1 if nothing valid follows it before the head. The span skipped must be able to hold a padding entry
+off_t find_next_log_entry(off_t torn) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+
+    for(off_t offset = torn + sizeof(struct wfs_log_entry); offset < sb->head; offset += WFS_ALIGNMENT) {
+        if(wfs_valid_log_entry_size(mapped_data, offset, sb->head) != 0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+// Helper function to check every log entry against its checksum. A bad entry in the middle of the log is turned into
+// padding up to the next entry that matches its checksum, and the log is only cut off at a bad entry nothing valid
+// follows. The log is split into ranges verified in parallel, then the ranges are stitched together in order, walking a
+// range again from where the entries before it lead whenever its own first boundary doesn't line up with that
+void verify_log() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    off_t log_size = sb->head - wfs_log_start(sb);
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_ranges = log_size / VERIFY_MIN_RANGE;
+    if(num_ranges > num_cpus) {
+        num_ranges = num_cpus;
+    }
+    if(num_ranges < 1) {
+        num_ranges = 1;
+    }
+
+    struct verify_range *ranges = calloc(num_ranges, sizeof(struct verify_range));
+    pthread_t *threads = calloc(num_ranges, sizeof(pthread_t));
+    if(ranges == NULL || threads == NULL) {
+        perror("Error allocating verifier ranges");
+        exit(EXIT_FAILURE);
+    }
+    off_t range_size = wfs_align(log_size / num_ranges, WFS_ALIGNMENT);
+    for(int i = 0; i < num_ranges; i++) {
+        ranges[i].start = wfs_log_start(sb) + i * range_size;
+        ranges[i].end = i == num_ranges - 1 ? sb->head : ranges[i].start + range_size;
+        if(pthread_create(&threads[i], NULL, verify_range_thread, &ranges[i]) != 0) {
+            perror("Error starting verifier thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(int i = 0; i < num_ranges; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // A range is only trusted from the offset the entries before it lead to, a boundary found anywhere else is data
+    // that happens to look like a log entry
+    off_t offset = wfs_log_start(sb);
+    for(int i = 0; i < num_ranges; i++) {
+        while(offset < ranges[i].end) {
+            if(ranges[i].first != offset) {
+                walk_log_entries(offset, &ranges[i]);
             }
-            if(flag == 1) {
-                continue;
+            offset = ranges[i].chain_end;
+            if(ranges[i].torn == -1) {
+                break;
+            }
+
+            off_t torn = ranges[i].torn;
+            off_t next = find_next_log_entry(torn);
+            if(next == -1) {
+                printf("Torn log entry at offset %ld, dropped the last %ld bytes of the log\n", (long)torn,
+                       (long)(sb->head - torn));
+                memset((char *)mapped_data + torn, 0, sb->head - torn);
+                sb->head = torn;
+                free(ranges);
+                free(threads);
+                return;
             }
+            printf("Bad log entry at offset %ld, dropped %ld bytes up to the next valid entry\n", (long)torn,
+                   (long)(next - torn));
+            write_padding(torn, next);
+            offset = next;
         }
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
     }
-    if(token == NULL) {
-        found_entry = log_entry; 
+    free(ranges);
+    free(threads);
+}
+
+// Helper function to find where compaction writes a log entry of entry_size bytes, at the first offset from write_offset
+// on that keeps to the alignment of the image unless the entry would end past limit there, in which case it goes right
+// at write_offset. The gap left in front of it is padded
+off_t place_log_entry(struct wfs_log_entry *log_entry, size_t entry_size, off_t write_offset, off_t limit) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    size_t length = 0;
+    size_t data_offset = wfs_file_data_offset(log_entry, &length);
+    off_t target = wfs_entry_offset(sb, write_offset, data_offset, length);
+    if(target + entry_size > limit) {
+        return write_offset;
     }
-    return found_entry;
+    if(target > write_offset) {
+        write_padding(write_offset, target);
+    }
+    return target;
 }
 
-// Helper function to find the highest inode number used by the log file system so far
-int find_max_inode_number() {
-    int max_inode_number = 0;
+// Helper function to mark the chunks referenced by live chunked log entries, which keeps those chunks alive
+void mark_referenced_chunks() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-    off_t current_offset = sizeof(struct wfs_sb);
+    off_t current_offset = wfs_log_start(sb);
     while (current_offset < sb->head) {
         struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
 
-        if(log_entry->inode.inode_number > max_inode_number) {
-            max_inode_number = log_entry->inode.inode_number;
+        if((log_entry->inode.flags & WFS_INODE_CHUNKED) && is_live_log_entry(log_entry, current_offset)) {
+            struct wfs_chunk_list *list = (struct wfs_chunk_list *)log_entry->data;
+            for(uint64_t i = 0; i < list->num_chunks; i++) {
+                grow_inode_states(list->chunks[i].inode_number);
+                inode_states[list->chunks[i].inode_number].referenced = 1;
+            }
         }
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+        current_offset += wfs_log_entry_size(log_entry, sb);
     }
-    return max_inode_number;
 }
 
 int main(int argc, char *argv[]) {
@@ -164,38 +752,105 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Allocate and initialize memory for the new compacted version of the log file system
-    new_mapped_data = malloc(disk_size);
-    memset(new_mapped_data, 0, disk_size);
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-    // Initialize the superblock
-    struct wfs_sb *new_sb = (struct wfs_sb *)new_mapped_data;
-    new_sb->magic = WFS_MAGIC;
-    new_sb->head = 0;
-    new_sb->head += sizeof(struct wfs_sb);
+    // Rewrite images of older versions in the current format first. The version of those before WFS_WIDE_MIN_VERSION
+    // sits where the low half of the head is now, which is always aligned and so never mistaken for one. Version 0 images
+    // have the inode number of their root directory there instead, which is 0
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    struct wfs_sb_v2 *old_sb = (struct wfs_sb_v2 *)mapped_data;
+    if (sb->magic == WFS_MAGIC && sb->version >= WFS_WIDE_MIN_VERSION && sb->version <= WFS_V7_VERSION) {
+        upgrade_image(sb->version);
+        sb = (struct wfs_sb *)mapped_data;
+    }
+    else if (sb->magic == WFS_MAGIC && (sb->version < WFS_WIDE_MIN_VERSION || sb->version > WFS_VERSION) &&
+             old_sb->version >= WFS_UPGRADE_MIN_VERSION && old_sb->version < WFS_WIDE_MIN_VERSION) {
+        upgrade_image(old_sb->version);
+        sb = (struct wfs_sb *)mapped_data;
+    }
+    else if (sb->magic == WFS_MAGIC && sb->version == WFS_V8_VERSION && wfs_valid_alignment(sb)) {
+        reseal_log();
+    }
 
-    // Find the highest inode number used by the log file system so far
-    int max_inode_number = find_max_inode_number();
+    // Refuse images formatted by an incompatible version of mkfs.wfs
+    if (sb->magic != WFS_MAGIC || sb->version < WFS_MIN_VERSION || sb->version > WFS_VERSION || !wfs_valid_alignment(sb)) {
+        fprintf(stderr, "Disk image is not a version %d to %d wfs filesystem\n", WFS_UPGRADE_MIN_VERSION, WFS_VERSION);
+        munmap(mapped_data, disk_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Drop whatever a crash left half written at the end of the log before trusting any entry
+    verify_log();
+    off_t old_head = sb->head;
+
+    // Entries are about to move, so the checkpoint no longer describes the log. Checkpoint entries are marked deleted
+    // and get dropped with the rest of the dead entries, the next unmount writes a fresh one
+    sb->checkpoint = 0;
+
+    // Find the most recent log entries of every inode number in a single pass, then the chunks still in use
+    scan_log();
+    mark_referenced_chunks();
+
+    // Slide live log entries towards the start of the log. Entries before write_offset are compacted and entries
+    // from read_offset on haven't been looked at, so anything written below read_offset never clobbers unread data
+    // Gathered entries of files not written out yet keep their space reserved between the two, so that padding in front
+    // of aligned entries never eats into it
+    off_t read_offset = wfs_log_start(sb);
+    off_t write_offset = wfs_log_start(sb);
+    off_t gathered_bytes = 0;
+    while (read_offset < old_head) {
+        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + read_offset);
+        size_t entry_size = wfs_log_entry_size(log_entry, sb);
+
+        if(!is_live_log_entry(log_entry, read_offset)) {
+            read_offset += entry_size;
+            continue;
+        }
 
-    // Iterate over all inode numbers assigned
-    for(int i = 0; i <= max_inode_number; i++) {
-        // Find the most recent log entry for an inode number
-        struct wfs_log_entry* log_entry = find_latest_log_entry(i);
-        
-        // If log entry doesn't exist or is deleted, continue
-        if(log_entry == NULL || log_entry->inode.deleted == 1) {
+        struct inode_state *state = &inode_states[log_entry->inode.inode_number];
+        if(!state->consolidate) {
+            off_t target = place_log_entry(log_entry, entry_size, write_offset, read_offset + entry_size - gathered_bytes);
+            memmove((char *)mapped_data + target, log_entry, entry_size);
+            write_offset = target + entry_size;
+            read_offset += entry_size;
             continue;
         }
 
-        // Copy only the most recent log entry for the inode number to the new compacted disk
-        struct wfs_log_entry *new_log_entry = (struct wfs_log_entry *)((char*)new_mapped_data + new_sb->head);
-        memcpy(new_log_entry, log_entry, sizeof(struct wfs_log_entry) + log_entry->inode.size);
-        new_sb->head += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+        // Gather the file into memory and write it out once its most recent entry has been read
+        consolidate_log_entry(log_entry);
+        state->gathered_bytes += entry_size;
+        gathered_bytes += entry_size;
+        read_offset += entry_size;
+        if(read_offset - entry_size != state->latest) {
+            continue;
+        }
+
+        // Every gathered entry widened the gap between write_offset and read_offset by its size, and the consolidated
+        // entry is no bigger than all of them together, so it fits without clobbering unread data
+        gathered_bytes -= state->gathered_bytes;
+        state->consolidated->inode.checksum = wfs_checksum(state->consolidated);
+        size_t consolidated_size = wfs_log_entry_size(state->consolidated, sb);
+        off_t target = place_log_entry(state->consolidated, consolidated_size, write_offset, read_offset - gathered_bytes);
+        memcpy((char *)mapped_data + target, state->consolidated, consolidated_size);
+        write_offset = target + consolidated_size;
+        free(state->consolidated);
+        state->consolidated = NULL;
     }
 
-    // Update the memory mapping of the disk to equal the compacted mapping
-    memset(mapped_data, 0, disk_size);
-    memcpy(mapped_data, new_mapped_data, disk_size);
+    // Clear the reclaimed space and move the head back
+    if(write_offset < old_head) {
+        memset((char *)mapped_data + write_offset, 0, old_head - write_offset);
+    }
+    sb->head = write_offset;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double elapsed_ms = (end_time.tv_sec - start_time.tv_sec) * 1000.0 + (end_time.tv_nsec - start_time.tv_nsec) / 1000000.0;
+    printf("Compacted log from %ld to %ld bytes, reclaimed %ld bytes in %.3f ms\n",
+           (long)old_head, (long)write_offset, (long)(old_head - write_offset), elapsed_ms);
+    free(inode_states);
+    free(dentry_positions);
 
     // Unmap the memory mapping
     if (munmap(mapped_data, disk_size) == -1) {
@@ -9,13 +9,24 @@
 #include <time.h>
 
 int main(int argc, char *argv[]) {
+    // -a aligns log entries to cache lines and large file data to pages
+    int aligned = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a")) != -1) {
+        if (opt != 'a') {
+            printf("Usage: %s [-a] <disk_path>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        aligned = 1;
+    }
+
     // Check if right number of arguments are provided
-    if (argc != 2) {
-        printf("Usage: %s <disk_path>\n", argv[0]);
+    if (argc - optind != 1) {
+        printf("Usage: %s [-a] <disk_path>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    const char *disk_path = argv[1];
+    const char *disk_path = argv[optind];
 
     // Open the disk file
     int fd = open(disk_path, O_RDWR);
@@ -25,7 +36,7 @@ int main(int argc, char *argv[]) {
     }
 
     // Find the size of the disk
-    int disk_size = lseek(fd, 0, SEEK_END);
+    off_t disk_size = lseek(fd, 0, SEEK_END);
     if (disk_size == -1) {
         perror("Error getting disk size");
         close(fd);
@@ -44,6 +55,14 @@ int main(int argc, char *argv[]) {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
     sb->magic = WFS_MAGIC;
     sb->head = 0;
+    sb->version = WFS_VERSION;
+
+    // No checkpoint yet, so the first mount replays the whole (single entry) log
+    sb->checkpoint = 0;
+
+    // Record the alignment of the log, which mount.wfs and fsck.wfs keep to from then on
+    sb->alignment = aligned ? WFS_CACHE_LINE_SIZE : WFS_ALIGNMENT;
+    sb->data_alignment = aligned ? WFS_PAGE_SIZE : 0;
 
     // Initialize the log entry for the root directory 
     struct wfs_inode root_inode;
@@ -61,12 +80,13 @@ int main(int argc, char *argv[]) {
     root_inode.links = 1;
 
 
-    struct wfs_log_entry *root_log_entry = (struct wfs_log_entry *)((char*)mapped_data + sizeof(struct wfs_sb));
+    struct wfs_log_entry *root_log_entry = (struct wfs_log_entry *)((char*)mapped_data + wfs_log_start(sb));
     memcpy(&root_log_entry->inode, &root_inode, sizeof(struct wfs_inode));
+    root_log_entry->inode.checksum = wfs_checksum(root_log_entry);
 
     // Update the head pointer of the superblock
-    sb->head += sizeof(struct wfs_log_entry);
-    sb->head += sizeof(struct wfs_sb);
+    sb->head += wfs_log_entry_size(root_log_entry, sb);
+    sb->head += wfs_log_start(sb);
 
     // Unmap the memory mapping
     if (munmap(mapped_data, disk_size) == -1) {
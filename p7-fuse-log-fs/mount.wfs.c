@@ -7,29 +7,262 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/mman.h>
 
-// Global variables for storing info related to the disk file and its memory mapping
+#define ROOT_INODE_NUMBER 0
+#define DIR_INDEX_MIN_BUCKETS 8
+#define CLEANER_FREE_FRACTION 4             // start cleaning once less than 1/4 of the disk is free
+#define CLEANER_BATCH_BYTES (64 * 1024)     // bytes of log examined per batch while holding the lock
+#define CLEANER_BATCH_DELAY_US 1000         // pause between batches to let foreground operations run
+#define CLEANER_POLL_MS 100
+#define CLEANER_CONSOLIDATE_EXTENTS 16      // fold files fragmented into more ranges than this into one entry, and
+                                            // directories with more updates than this and than they have entries
+#define SEGMENT_SIZE (64 * 1024)            // unit of log the cleaner accounts live bytes in to choose where a pass starts
+#define MAX_SEGMENTS 4096                   // segments are made larger on big disk images to stay below this many
+#define CHECKPOINT_INTERVAL_BYTES (256 * 1024) // bytes appended after a checkpoint before the next one is written
+#define MAX_DISK_SIZE (1L << 40)            // address space reserved for the mapping, the disk image can't grow past it
+#define CHUNK_MIN_SIZE 2048                 // smallest chunk, smaller writes are stored inline even with dedup
+#define CHUNK_MAX_SIZE (64 * 1024)
+#define CHUNK_AVG_BITS 13                   // chunks end where this many bits of the rolling hash are zero, every 8 KB
+#define CHUNK_INDEX_MIN_BUCKETS 64
+#define COMPRESS_MIN_SIZE 256               // smallest file data worth compressing
+#define COMPRESS_HASH_BITS 12               // the compressor finds matches through a table of this many bits of hash
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_DISTANCE 65535
+#define DECOMPRESS_CACHE_SLOTS 16           // decompressed log entries kept around for reads
+#define WRITE_BUFFER_SIZE (1024 * 1024)     // bytes of contiguous writes an open file buffers before appending them
+#define STATS_PATH "/.wfs_stats"            // read-only file reporting the statistics of mount.wfs, not listed in /
+#define STATS_LATENCY_BUCKETS 24            // latency histogram buckets, doubling from under 1 us
+#define ENTRY_TIMEOUT "60"                  // seconds the kernel caches names looked up or listed by readdir
+#define ATTR_TIMEOUT "60"                   // seconds the kernel caches attributes
+#define UNLOCKED_APPEND_MIN_SIZE (16 * 1024) // extents at least this big are copied into the log while reads go on
+
+// In-memory index of the entries of a directory, rebuilt from its log entries at mount
+struct dir_index {
+    struct wfs_dentry *dentries;    // current entries of the directory in no particular order
+    int *next;                      // next entry in the same hash bucket as each entry, -1 at the end of a chain
+    int num_dentries;
+    int dentries_capacity;
+    int *buckets;                   // first entry of each hash bucket, -1 if the bucket is empty
+    int num_buckets;                // power of two
+};
+
+// Range of a file whose current contents live in an extent log entry
+struct extent_ref {
+    off_t file_offset;
+    size_t length;
+    off_t entry_offset;         // offset of the extent log entry holding the bytes
+    size_t data_offset;         // offset of the bytes within the data of that extent
+};
+
+// In-memory state of an inode, rebuilt from the log at mount
+struct inode_info {
+    off_t latest;               // offset of the most recent log entry of any kind (-1 if it has none)
+    off_t base;                 // offset of the most recent log entry holding the whole file
+    struct extent_ref *extents; // ranges overriding base, sorted by file offset and non-overlapping. For directories the
+                                // entry updates appended after base in log order, with only entry_offset set
+    int num_extents;
+    int extents_capacity;
+    struct dir_index *dir;      // entries of a directory, NULL for files
+};
+
+// Summary of a fixed-size segment of the log, rebuilt from the inode index at the start of every cleaning pass
+struct segment_usage {
+    off_t live_bytes;           // bytes of live log entries within the segment
+    unsigned int newest_mtime;  // most recent modify time of a live log entry in the segment, 0 if it has none
+    off_t clean_start;          // end of the last live log entry starting before the segment, where a pass cleaning
+                                // the segment and everything after it starts
+};
+
+// Global variables for storing info related to the disk file and its memory mapping. The mapping sits at the start of
+// mapping_size bytes of reserved address space, so growing the disk image never moves it
 int fd;
 void* mapped_data;
-int disk_size;
+off_t disk_size;
+off_t mapping_size;
+
+// Entry of the in-memory index of chunks, chained by the hash of their data
+struct chunk_index_entry {
+    uint64_t hash;
+    unsigned int inode_number;
+    int next;                   // next entry in the same hash bucket, -1 at the end of a chain
+};
+
+// In-memory index from inode number to the log entries that make up its current state
+struct inode_info* inode_index;
+int inode_index_capacity;
+unsigned int max_inode_number;  // highest inode number ever seen in the log
+
+// Writes through an open file that are not appended to the log yet, a single range of the file that writes continuing
+// or overlapping it extend. Buffers of the same file never overlap
+struct write_buffer {
+    unsigned int inode_number;
+    int removed;                // 1 once the file was removed, its inode number is reused after the last one is released
+    off_t offset;
+    size_t length;              // 0 if nothing is buffered
+    size_t capacity;
+    char *data;
+    struct write_buffer *prev;
+    struct write_buffer *next;
+};
+
+// List of the write buffers of all files open for writing, changed under fs_lock held exclusively
+struct write_buffer* write_buffers;
+
+// Ranges of the disk image the replies read_buf handed out on one FUSE thread refer to. libfuse reads them after
+// read_buf returns and fs_lock is released, and sends the reply before the thread takes its next request, so they are
+// held until the next read_buf on the thread or until it exits. The cleaner leaves entries overlapping them in place
+struct read_pins {
+    off_t *ranges;              // start and end offset of every range
+    int num_ranges;
+    int ranges_capacity;
+    struct read_pins *prev;
+    struct read_pins *next;
+};
+
+// List of the pins of every thread that served read_buf, changed under read_pins_lock. Pins are only added with fs_lock
+// held shared, so the cleaner sees all of them while it holds fs_lock exclusively
+pthread_mutex_t read_pins_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t read_pins_key;
+struct read_pins* read_pins;
+
+// Options of mount.wfs, given with -o among the FUSE options. Log entries written with either are read whether or not
+// it is set
+struct wfs_options {
+    int dedup;                  // split written data into chunks and store every distinct chunk once
+    int compress;               // compress written data
+};
+struct wfs_options options;
+
+uint64_t chunk_gear[256];       // random value rolled into the hash that finds chunk boundaries for every byte value
+
+// Index from the hash of a chunk to the inode numbers of the chunk log entries with that hash, rebuilt by every cleaning
+// pass once unreferenced chunks are deleted
+struct chunk_index_entry* chunk_entries;
+int num_chunks;
+int chunks_capacity;
+int* chunk_buckets;             // first entry of each hash bucket, -1 if the bucket is empty
+int num_chunk_buckets;          // power of two
+
+// Stack of inode numbers below max_inode_number that are not in use and can be handed out again
+unsigned int* free_inodes;
+int num_free_inodes;
+int free_inodes_capacity;
+
+// Lock protecting the log and the inode index. Operations that only read take it shared and run concurrently, while
+// operations that append to the log and the cleaner take it exclusively
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Lock serializing operations that append to the log and the cleaner, taken before fs_lock. Whoever holds it is the
+// only one changing the log, the inode index and the head, so it can fill a log entry past the head with fs_lock
+// released and take fs_lock exclusively only to index the entry and publish the new head. Reads hold fs_lock shared
+// for the whole operation, which pins the head and so resolves everything against the entries before it
+pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// State of the background log cleaner, protected by cleaner_lock which is taken after fs_lock when both are needed
+pthread_mutex_t cleaner_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cleaner_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cleaner_done_cond = PTHREAD_COND_INITIALIZER;
+pthread_t cleaner_thread;
+int cleaner_running;
+int cleaner_requested;          // set by operations that ran out of space to force a pass
+unsigned long cleaner_passes;   // number of completed cleaning passes
+off_t cleaner_last_head;        // head of the log when the last pass completed
+
+// State of group commit, protected by sync_lock. Callers of fsync that arrive while a commit is running wait for it and
+// share the next one, so concurrent writers pay for one msync between them
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+int sync_in_progress;
+unsigned long syncs_started;
+unsigned long syncs_completed;  // number of the last commit that reached the disk
+off_t dirty_offset;             // the log may differ from the disk from here to the head. Lowered under fs_lock held
+                                // exclusively, advanced under fs_lock held shared by the one thread committing or
+                                // exclusively by the cleaner
+
+// Cache of the data of compressed log entries, so that reading a file piece by piece only decompresses every entry once.
+// Slots are keyed by the offset of the log entry and the cache is emptied whenever the cleaner moves entries
+struct decompress_cache_slot {
+    off_t entry_offset;         // -1 if the slot is empty
+    char *data;
+    unsigned long last_used;
+};
+pthread_mutex_t decompress_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct decompress_cache_slot decompress_cache[DECOMPRESS_CACHE_SLOTS];
+unsigned long decompress_cache_clock;
+
+// Operations whose calls and latency are counted
+enum wfs_op { OP_GETATTR, OP_MKNOD, OP_MKDIR, OP_OPEN, OP_READ, OP_WRITE, OP_READDIR, OP_UNLINK, OP_RMDIR, OP_RENAME,
+              OP_TRUNCATE, OP_UTIMENS, OP_FSYNC, OP_FLUSH, OP_RELEASE, NUM_OPS };
+const char *op_names[NUM_OPS] = { "getattr", "mknod", "mkdir", "open", "read", "write", "readdir", "unlink", "rmdir",
+                                  "rename", "truncate", "utimens", "fsync", "flush", "release" };
+
+// Calls of an operation, counted with relaxed atomics so that counting can always stay on
+struct op_stats {
+    unsigned long calls;
+    unsigned long total_us;
+    unsigned long latency_buckets[STATS_LATENCY_BUCKETS]; // calls that took less than 2^i us, the last bucket the rest
+};
+struct op_stats op_stats[NUM_OPS];
+
+// Other counters reported at STATS_PATH, also updated with relaxed atomics
+struct wfs_stats {
+    unsigned long dentry_hits;          // names found by directory lookups
+    unsigned long dentry_misses;
+    unsigned long chunk_hits;           // chunks written with dedup that were stored already
+    unsigned long chunk_misses;
+    unsigned long decompress_hits;      // reads of compressed entries served by the decompress cache
+    unsigned long decompress_misses;
+    unsigned long cleaner_bytes_moved;
+    unsigned long cleaner_bytes_reclaimed;
+    unsigned long cleaner_consolidations;
+    unsigned long cleaner_pinned_entries; // entries the cleaner left in place for replies of read_buf
+    unsigned long checkpoints;
+};
+struct wfs_stats stats;
+off_t mount_head;               // head of the log at mount, bytes appended since are the head past it plus reclaimed bytes
+
+// Helper function to add to a counter of the statistics
+void stat_add(unsigned long *counter, unsigned long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
 
 // Helper function to print all entries of the log structured filesystem
 void print_log_entries() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-    off_t current_offset = sizeof(struct wfs_sb);
+    off_t current_offset = wfs_log_start(sb);
     while (current_offset < sb->head) {
         struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
 
         if(log_entry->inode.deleted == 1) {
-            current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+            current_offset += wfs_log_entry_size(log_entry, sb);
             continue;
         }
 
-        printf("Inode Number: %u, Mode: %u, Size: %u\n", log_entry->inode.inode_number, log_entry->inode.mode, log_entry->inode.size);
-
-        if (S_ISDIR(log_entry->inode.mode)) {
+        printf("Inode Number: %u, Mode: %u, Size: %lu\n", log_entry->inode.inode_number, log_entry->inode.mode, log_entry->inode.size);
+
+        if (log_entry->inode.flags & WFS_INODE_TOMBSTONE) {
+            printf("This is a tombstone\n");
+        } else if (log_entry->inode.flags & WFS_INODE_CHUNKED) {
+            struct wfs_chunk_list *list = (struct wfs_chunk_list *)log_entry->data;
+            printf("This is a chunked file %s (Offset: %lu, Length: %lu, Chunks: %lu)\n", log_entry->inode.flags & WFS_INODE_EXTENT ? "extent" : "entry",
+                   list->offset, list->length, list->num_chunks);
+        } else if (log_entry->inode.flags & WFS_INODE_CHUNK) {
+            printf("This is a chunk of file data\n");
+        } else if (log_entry->inode.flags & WFS_INODE_EXTENT) {
+            struct wfs_extent *extent = (struct wfs_extent *)log_entry->data;
+            printf("This is a file extent (Offset: %lu, Length: %lu)\n", extent->offset, extent->length);
+        } else if (log_entry->inode.flags & WFS_INODE_DENTRY) {
+            struct wfs_dentry_update *update = (struct wfs_dentry_update *)log_entry->data;
+            if(update->op == WFS_DENTRY_NONE) {
+                printf("This is a directory inode update\n");
+            } else {
+                printf("  %s: %s (Inode: %lu)\n", update->op == WFS_DENTRY_ADD ? "Added" : "Removed", update->dentry.name, update->dentry.inode_number);
+            }
+        } else if (S_ISDIR(log_entry->inode.mode)) {
             struct wfs_dentry *entries = (struct wfs_dentry *)log_entry->data;
             int num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
 
@@ -40,241 +273,2857 @@ void print_log_entries() {
             printf("This is a file\n");
         }
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+        current_offset += wfs_log_entry_size(log_entry, sb);
     }
 }
 
-// Helper function to mark all log entries corresponding to an inode number as deleted
-int delete_log_entries(int inode_number) {
-    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    int flag = 0;
+// Helper function to hash the name of a directory entry
+unsigned int dir_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    for(const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
 
-    off_t current_offset = sizeof(struct wfs_sb);
-    while (current_offset < sb->head) {
-        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
+// Helper function to add the entry at a position of a directory index to the hash chain of its name
+void dir_link(struct dir_index *dir, int index) {
+    unsigned int bucket = dir_hash(dir->dentries[index].name) & (dir->num_buckets - 1);
+    dir->next[index] = dir->buckets[bucket];
+    dir->buckets[bucket] = index;
+}
 
-        if(log_entry->inode.inode_number == inode_number && log_entry->inode.deleted == 0) {
-            log_entry->inode.deleted = 1;
-            flag = 1;
+// Helper function to remove the entry at a position of a directory index from the hash chain of its name
+void dir_unlink(struct dir_index *dir, int index) {
+    int *link = &dir->buckets[dir_hash(dir->dentries[index].name) & (dir->num_buckets - 1)];
+    while(*link != index) {
+        link = &dir->next[*link];
+    }
+    *link = dir->next[index];
+}
+
+// Helper function to change the number of hash buckets of a directory index and rehash its entries
+void dir_resize(struct dir_index *dir, int num_buckets) {
+    int *buckets = malloc(num_buckets * sizeof(int));
+    if(buckets == NULL) {
+        perror("Error growing directory index");
+        exit(EXIT_FAILURE);
+    }
+    free(dir->buckets);
+    dir->buckets = buckets;
+    dir->num_buckets = num_buckets;
+    for(int i = 0; i < num_buckets; i++) {
+        dir->buckets[i] = -1;
+    }
+    for(int i = 0; i < dir->num_dentries; i++) {
+        dir_link(dir, i);
+    }
+}
+
+// Helper function to find the position of a name within a directory index (-1 if it isn't there)
+int dir_find(struct dir_index *dir, const char *name) {
+    for(int i = dir->buckets[dir_hash(name) & (dir->num_buckets - 1)]; i != -1; i = dir->next[i]) {
+        if(strcmp(dir->dentries[i].name, name) == 0) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+// Helper function to add an entry to a directory index
+void dir_add(struct dir_index *dir, const struct wfs_dentry *dentry) {
+    if(dir->num_dentries == dir->dentries_capacity) {
+        dir->dentries_capacity = dir->dentries_capacity > 0 ? dir->dentries_capacity * 2 : DIR_INDEX_MIN_BUCKETS;
+        dir->dentries = realloc(dir->dentries, dir->dentries_capacity * sizeof(struct wfs_dentry));
+        dir->next = realloc(dir->next, dir->dentries_capacity * sizeof(int));
+        if(dir->dentries == NULL || dir->next == NULL) {
+            perror("Error growing directory index");
+            exit(EXIT_FAILURE);
+        }
     }
-    if(flag == 1) {
-        return flag;
+
+    int index = dir->num_dentries++;
+    memcpy(&dir->dentries[index], dentry, sizeof(struct wfs_dentry));
+    dir->dentries[index].name[MAX_FILE_NAME_LEN - 1] = '\0';
+    if(dir->num_dentries > dir->num_buckets) {
+        dir_resize(dir, dir->num_buckets * 2);
     }
     else {
-        return -1;
+        dir_link(dir, index);
     }
 }
 
-// Helper function to separate filename and path to the directory that the file is located in
-void separate_path_and_file(const char *path, struct wfs_path_info *info) {
-    const char *filename = strrchr(path, '/');
+// Helper function to remove the entry at a position of a directory index by moving the last entry into its place
+void dir_remove(struct dir_index *dir, int index) {
+    int last = dir->num_dentries - 1;
+    dir_unlink(dir, index);
+    if(index != last) {
+        dir_unlink(dir, last);
+        memcpy(&dir->dentries[index], &dir->dentries[last], sizeof(struct wfs_dentry));
+        dir_link(dir, index);
+    }
+    dir->num_dentries--;
+}
 
-    if (filename != NULL) {
-        filename++;
+// Helper function to free a directory index
+void dir_free(struct dir_index *dir) {
+    if(dir == NULL) {
+        return;
+    }
+    free(dir->dentries);
+    free(dir->next);
+    free(dir->buckets);
+    free(dir);
+}
 
-        size_t path_len = filename - path - 1;
+// Helper function to apply a log entry of a directory to its index, either replacing every entry or updating one
+void dir_apply(struct inode_info *info, struct wfs_log_entry *log_entry) {
+    if(info->dir == NULL) {
+        info->dir = calloc(1, sizeof(struct dir_index));
+        if(info->dir == NULL) {
+            perror("Error allocating directory index");
+            exit(EXIT_FAILURE);
+        }
+        dir_resize(info->dir, DIR_INDEX_MIN_BUCKETS);
+    }
+    struct dir_index *dir = info->dir;
+
+    if(!(log_entry->inode.flags & WFS_INODE_DENTRY)) {
+        struct wfs_dentry *entries = (struct wfs_dentry *)log_entry->data;
+        int num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
+        dir->num_dentries = 0;
+        for(int i = 0; i < dir->num_buckets; i++) {
+            dir->buckets[i] = -1;
+        }
+        for(int i = 0; i < num_entries; i++) {
+            dir_add(dir, &entries[i]);
+        }
+        return;
+    }
 
-        strncpy(info->parent_path, path, path_len);
-        info->parent_path[path_len] = '\0';
+    // A crash in the middle of a cleaning pass can leave a run of updates in the log twice, so adding a name that is
+    // already bound to the same inode changes nothing
+    struct wfs_dentry_update *update = (struct wfs_dentry_update *)log_entry->data;
+    if(update->op == WFS_DENTRY_ADD) {
+        int index = dir_find(dir, update->dentry.name);
+        if(index == -1 || dir->dentries[index].inode_number != update->dentry.inode_number) {
+            dir_add(dir, &update->dentry);
+        }
+        return;
+    }
+    if(update->op == WFS_DENTRY_NONE) {
+        return;
+    }
 
-        strncpy(info->filename, filename, MAX_FILE_NAME_LEN - 1);
-        info->filename[MAX_FILE_NAME_LEN - 1] = '\0';
-    } else {
-        strcpy(info->parent_path, "/");
-        strncpy(info->filename, path, MAX_FILE_NAME_LEN - 1);
-        info->filename[MAX_FILE_NAME_LEN - 1] = '\0';
+    // Removals name the inode the name pointed to when they were appended, which unlink, rmdir and both sides of a
+    // rename all know, so only the entry binding that name to that inode is dropped
+    unsigned int bucket = dir_hash(update->dentry.name) & (dir->num_buckets - 1);
+    for(int i = dir->buckets[bucket]; i != -1; i = dir->next[i]) {
+        if(dir->dentries[i].inode_number == update->dentry.inode_number && strcmp(dir->dentries[i].name, update->dentry.name) == 0) {
+            dir_remove(dir, i);
+            return;
+        }
     }
 }
 
-// Helper function to find the most recent log entry for an inode number
-struct wfs_log_entry* find_latest_log_entry(unsigned int inode_number) {
-    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    struct wfs_log_entry* latest_entry = NULL;
+// Helper function to forget the log entries of an inode number
+void clear_inode_info(unsigned int inode_number) {
+    if(inode_number >= inode_index_capacity) {
+        return;
+    }
+    struct inode_info *info = &inode_index[inode_number];
+    free(info->extents);
+    dir_free(info->dir);
+    info->latest = -1;
+    info->base = -1;
+    info->extents = NULL;
+    info->num_extents = 0;
+    info->extents_capacity = 0;
+    info->dir = NULL;
+}
 
-    off_t current_offset = sizeof(struct wfs_sb);
-    while (current_offset < sb->head) {
-        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
+// Helper function to find the first range of the extent map that ends after a file offset
+int find_extent(struct inode_info *info, off_t file_offset) {
+    int low = 0;
+    int high = info->num_extents;
+    while(low < high) {
+        int mid = (low + high) / 2;
+        if(info->extents[mid].file_offset + info->extents[mid].length <= file_offset) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to make room for a number of ranges in the extent map
+void grow_extents(struct inode_info *info, int num_extents) {
+    if(num_extents > info->extents_capacity) {
+        info->extents_capacity = info->extents_capacity > 0 ? info->extents_capacity * 2 : 8;
+        info->extents = realloc(info->extents, info->extents_capacity * sizeof(struct extent_ref));
+        if(info->extents == NULL) {
+            perror("Error growing extent map");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-        if(log_entry->inode.inode_number == inode_number && log_entry->inode.deleted == 0) {
-            latest_entry = log_entry;
+// Helper function to find the directory entry update at a log offset in the extents of a directory (-1 if it isn't there)
+int find_dentry_update(struct inode_info *info, off_t entry_offset) {
+    int low = 0;
+    int high = info->num_extents;
+    while(low < high) {
+        int mid = (low + high) / 2;
+        if(info->extents[mid].entry_offset < entry_offset) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
         }
+    }
+    return low < info->num_extents && info->extents[low].entry_offset == entry_offset ? low : -1;
+}
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+// Helper function to add a newly written extent to the extent map, trimming the ranges it overwrites
+void insert_extent(struct inode_info *info, off_t file_offset, size_t length, off_t entry_offset) {
+    off_t end = file_offset + length;
+
+    // Ranges first to last - 1 overlap the new extent
+    int first = find_extent(info, file_offset);
+    int last = first;
+    while(last < info->num_extents && info->extents[last].file_offset < end) {
+        last++;
+    }
+
+    // Keep the parts of the first and last overlapping ranges that stick out of the new extent
+    struct extent_ref replacement[3];
+    int num_replacements = 0;
+    if(first < last && info->extents[first].file_offset < file_offset) {
+        replacement[num_replacements] = info->extents[first];
+        replacement[num_replacements].length = file_offset - info->extents[first].file_offset;
+        num_replacements++;
+    }
+    replacement[num_replacements].file_offset = file_offset;
+    replacement[num_replacements].length = length;
+    replacement[num_replacements].entry_offset = entry_offset;
+    replacement[num_replacements].data_offset = 0;
+    num_replacements++;
+    if(first < last && info->extents[last - 1].file_offset + info->extents[last - 1].length > end) {
+        struct extent_ref *overlap = &info->extents[last - 1];
+        replacement[num_replacements].file_offset = end;
+        replacement[num_replacements].length = overlap->file_offset + overlap->length - end;
+        replacement[num_replacements].entry_offset = overlap->entry_offset;
+        replacement[num_replacements].data_offset = overlap->data_offset + (end - overlap->file_offset);
+        num_replacements++;
     }
 
-    return latest_entry;
+    int new_num_extents = info->num_extents - (last - first) + num_replacements;
+    grow_extents(info, new_num_extents);
+    memmove(&info->extents[first + num_replacements], &info->extents[last], (info->num_extents - last) * sizeof(struct extent_ref));
+    memcpy(&info->extents[first], replacement, num_replacements * sizeof(struct extent_ref));
+    info->num_extents = new_num_extents;
 }
 
-// Helper function to find the most recent log entry for a given path
-struct wfs_log_entry* find_log_entry_by_path(const char *path) {
+// Helper function to drop the parts of the extent map past the end of a file that was truncated
+void trim_extents(struct inode_info *info, off_t size) {
+    int first = find_extent(info, size);
+    if(first < info->num_extents && info->extents[first].file_offset < size) {
+        info->extents[first].length = size - info->extents[first].file_offset;
+        first++;
+    }
+    info->num_extents = first;
+}
+
+// Helper function to grow the inode index so that it covers an inode number
+void grow_inode_index(unsigned int inode_number) {
+    if(inode_number >= inode_index_capacity) {
+        int old_capacity = inode_index_capacity;
+        int new_capacity = inode_index_capacity > 0 ? inode_index_capacity : 64;
+        while(new_capacity <= inode_number) {
+            new_capacity *= 2;
+        }
+        inode_index = realloc(inode_index, new_capacity * sizeof(struct inode_info));
+        if(inode_index == NULL) {
+            perror("Error growing inode index");
+            exit(EXIT_FAILURE);
+        }
+        memset(&inode_index[old_capacity], 0, (new_capacity - old_capacity) * sizeof(struct inode_info));
+        for(int i = old_capacity; i < new_capacity; i++) {
+            inode_index[i].latest = -1;
+            inode_index[i].base = -1;
+        }
+        inode_index_capacity = new_capacity;
+    }
+}
+
+// Helper function to record a log entry as the most recent one for its inode number
+void index_log_entry(struct wfs_log_entry *log_entry) {
+    unsigned int inode_number = log_entry->inode.inode_number;
+    off_t offset = (char *)log_entry - (char *)mapped_data;
+
+    grow_inode_index(inode_number);
+    if(inode_number > max_inode_number) {
+        max_inode_number = inode_number;
+    }
+
+    // A tombstone removes the inode, whatever was written before it
+    if(log_entry->inode.flags & WFS_INODE_TOMBSTONE) {
+        clear_inode_info(inode_number);
+        return;
+    }
+
+    struct inode_info *info = &inode_index[inode_number];
+    off_t previous = info->latest;
+    info->latest = offset;
+
+    // Directories keep every entry update appended after the whole directory was last written, in log order
+    if(S_ISDIR(log_entry->inode.mode)) {
+        if(log_entry->inode.flags & WFS_INODE_DENTRY) {
+            grow_extents(info, info->num_extents + 1);
+            memset(&info->extents[info->num_extents], 0, sizeof(struct extent_ref));
+            info->extents[info->num_extents].entry_offset = offset;
+            info->num_extents++;
+        }
+        else {
+            info->base = offset;
+            info->num_extents = 0;
+        }
+        dir_apply(info, log_entry);
+        return;
+    }
+
+    // A log entry holding the whole file supersedes every extent written before it
+    if(!(log_entry->inode.flags & WFS_INODE_EXTENT)) {
+        info->base = offset;
+        info->num_extents = 0;
+        return;
+    }
+
+    // Chunked extents start with the same fields as plain ones. Only a truncate makes a file smaller, and then nothing past
+    // the new size is part of it any more. Whatever was cut off is hidden behind a range taken by the empty extent of the
+    // truncate, which keeps the truncate live for as long as anything it cut off still is
+    struct wfs_extent *extent = (struct wfs_extent *)log_entry->data;
+    if(extent->length > 0) {
+        insert_extent(info, extent->offset, extent->length, offset);
+    }
+    else if(previous != -1) {
+        struct wfs_log_entry *previous_entry = (struct wfs_log_entry *)((char *)mapped_data + previous);
+        if(previous_entry->inode.size > log_entry->inode.size) {
+            trim_extents(info, log_entry->inode.size);
+            insert_extent(info, log_entry->inode.size, previous_entry->inode.size - log_entry->inode.size, offset);
+        }
+    }
+}
+
+// Helper function to move the head past a complete log entry written at the head. Called with fs_lock held exclusively,
+// and the head is only ever read under fs_lock, so readers see the whole entry once they see the new head
+void publish_head(struct wfs_log_entry *log_entry) {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    struct wfs_log_entry *found_entry = NULL;
-    off_t current_offset = sizeof(struct wfs_sb);
-    struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + sizeof(struct wfs_sb));
+    off_t offset = (char *)log_entry - (char *)mapped_data;
+    sb->head = offset + wfs_log_entry_size(log_entry, sb);
+}
 
-    char *token, *saveptr;
-    char path_copy[MAX_PATH_NAME_LEN];
-    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
+// Helper function to seal the log entry just written at the head with its checksum and move the head past it
+void advance_head(struct wfs_log_entry *log_entry) {
+    log_entry->inode.checksum = wfs_checksum(log_entry);
+    publish_head(log_entry);
+}
 
-    token = strtok_r(path_copy, "/", &saveptr);
+// Helper function to mark the dead space between two offsets as a deleted log entry so that log scans skip over it
+void write_padding(off_t start_offset, off_t end_offset) {
+    struct wfs_log_entry *padding = (struct wfs_log_entry *)((char*)mapped_data + start_offset);
+    memset(&padding->inode, 0, sizeof(struct wfs_inode));
+    padding->inode.deleted = 1;
+    padding->inode.flags = WFS_INODE_PADDING;
+    padding->inode.size = end_offset - start_offset - sizeof(struct wfs_log_entry);
+    padding->inode.checksum = wfs_checksum(padding);
+}
 
-    if(token == NULL) {
-        int inode_number = log_entry->inode.inode_number;
-        return find_latest_log_entry(inode_number);
+// Helper function to find where the next log entry goes, which is the head once it is padded to the alignment of the
+// image. Entries holding a page or more of file data at data_offset start where that data is page aligned. The padding
+// only becomes part of the log when advance_head publishes the entry after it
+struct wfs_log_entry *head_log_entry(size_t data_offset, size_t length) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    off_t start = wfs_entry_offset(sb, sb->head, data_offset, length);
+    if(start > sb->head) {
+        write_padding(sb->head, start);
     }
+    return (struct wfs_log_entry *)((char *)mapped_data + start);
+}
 
-    while (token != NULL && current_offset < sb->head) {
-        log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
+// Helper function to check if a log entry of entry_size bytes placed at offset either ends at limit or leaves room for
+// a padding entry before it
+int entry_fits(off_t offset, size_t entry_size, off_t limit) {
+    off_t end = offset + entry_size;
+    return end == limit || (end < limit && limit - end >= sizeof(struct wfs_log_entry));
+}
 
-        if (S_ISDIR(log_entry->inode.mode)) {
-            struct wfs_dentry *entries = (struct wfs_dentry *)log_entry->data;
-            int num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
+// Helper function to find where the cleaner moves a log entry of entry_size bytes, at the first offset from write_offset
+// on that keeps to the alignment of the image unless the entry doesn't fit before limit there, in which case it goes
+// right at write_offset. The gap left in front of it is padded. Returns -1 if it doesn't fit before limit at all
+off_t place_log_entry(struct wfs_log_entry *log_entry, size_t entry_size, off_t write_offset, off_t limit) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    size_t length = 0;
+    size_t data_offset = wfs_file_data_offset(log_entry, &length);
+    off_t target = wfs_entry_offset(sb, write_offset, data_offset, length);
+    if(!entry_fits(target, entry_size, limit)) {
+        return entry_fits(write_offset, entry_size, limit) ? write_offset : -1;
+    }
+    if(target > write_offset) {
+        write_padding(write_offset, target);
+    }
+    return target;
+}
 
-            int i;
-            int flag = 0;
-            for (i = 0; i < num_entries; ++i) {
-                if (strcmp(entries[i].name, token) == 0) {
-                    struct wfs_log_entry *temp = find_latest_log_entry(entries[i].inode_number);
-                    if(temp == NULL) {
-                        continue;
-                    }
-                    log_entry = temp;
-                    current_offset = (char*)log_entry - (char*)mapped_data;
-                    token = strtok_r(NULL, "/", &saveptr);
-                    flag = 1;
-                    break;
-                }
+// Helper function to load the inode index saved by the most recent checkpoint, returns -1 if there is no usable one
+int load_checkpoint() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+
+    if(sb->checkpoint < wfs_log_start(sb) || sb->checkpoint + sizeof(struct wfs_log_entry) > sb->head) {
+        return -1;
+    }
+    struct wfs_log_entry *checkpoint_entry = (struct wfs_log_entry *)((char *)mapped_data + sb->checkpoint);
+    if(!(checkpoint_entry->inode.flags & WFS_INODE_CHECKPOINT) ||
+       wfs_valid_log_entry_size(mapped_data, sb->checkpoint, sb->head) == 0) {
+        return -1;
+    }
+
+    // Make sure the records fit in the entry before trusting any of them
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint *)checkpoint_entry->data;
+    size_t payload_size = sizeof(struct wfs_checkpoint) + checkpoint->num_inodes * sizeof(struct wfs_imap_entry) +
+                          checkpoint->num_extents * sizeof(struct wfs_imap_extent);
+    if(payload_size != checkpoint_entry->inode.size) {
+        return -1;
+    }
+
+    struct wfs_imap_entry *imap = (struct wfs_imap_entry *)checkpoint->data;
+    struct wfs_imap_extent *extents = (struct wfs_imap_extent *)&imap[checkpoint->num_inodes];
+    unsigned long total_extents = 0;
+    for(unsigned int i = 0; i < checkpoint->num_inodes; i++) {
+        if(imap[i].latest < wfs_log_start(sb) || imap[i].latest >= sb->checkpoint) {
+            return -1;
+        }
+        total_extents += imap[i].num_extents;
+    }
+    if(total_extents != checkpoint->num_extents) {
+        return -1;
+    }
+
+    unsigned int next_extent = 0;
+    for(unsigned int i = 0; i < checkpoint->num_inodes; i++) {
+        struct wfs_imap_entry *record = &imap[i];
+        struct wfs_imap_extent *record_extents = &extents[next_extent];
+        next_extent += record->num_extents;
+
+        // Chunks collected after the checkpoint, and files removed after it before tombstones, have their entries marked
+        // deleted. Files removed with a tombstone are dropped when the replay reaches it
+        struct wfs_log_entry *latest = (struct wfs_log_entry *)((char *)mapped_data + record->latest);
+        if(latest->inode.deleted == 1 || latest->inode.inode_number != record->inode_number) {
+            continue;
+        }
+
+        grow_inode_index(record->inode_number);
+        struct inode_info *info = &inode_index[record->inode_number];
+        info->latest = record->latest;
+        info->base = record->base != 0 ? record->base : -1;
+        if(record->num_extents > 0) {
+            info->extents = malloc(record->num_extents * sizeof(struct extent_ref));
+            if(info->extents == NULL) {
+                perror("Error loading extent map");
+                exit(EXIT_FAILURE);
             }
-            if(flag == 1) {
-                continue;
+            for(unsigned int j = 0; j < record->num_extents; j++) {
+                info->extents[j].file_offset = record_extents[j].file_offset;
+                info->extents[j].length = record_extents[j].length;
+                info->extents[j].entry_offset = record_extents[j].entry_offset;
+                info->extents[j].data_offset = record_extents[j].data_offset;
+            }
+            info->num_extents = record->num_extents;
+            info->extents_capacity = record->num_extents;
+        }
+
+        // Directory indexes aren't part of the checkpoint, replay the entries they are built from
+        if(S_ISDIR(latest->inode.mode)) {
+            if(info->base != -1) {
+                dir_apply(info, (struct wfs_log_entry *)((char *)mapped_data + info->base));
+            }
+            for(int j = 0; j < info->num_extents; j++) {
+                dir_apply(info, (struct wfs_log_entry *)((char *)mapped_data + info->extents[j].entry_offset));
             }
         }
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
-    }
-    if(token == NULL) {
-        found_entry = log_entry; 
     }
-    return found_entry;
+    max_inode_number = checkpoint->max_inode_number;
+    return 0;
 }
 
-// Helper function to find the highest inode number used by the log file system so far
-int find_max_inode_number() {
-    int max_inode_number = 0;
+// Helper function to build the inode index from the most recent checkpoint and the log entries appended after it
+void build_inode_index() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-    off_t current_offset = sizeof(struct wfs_sb);
+    // Without a checkpoint the whole log has to be replayed
+    off_t current_offset = wfs_log_start(sb);
+    if(load_checkpoint() == 0) {
+        current_offset = sb->checkpoint;
+    }
+
     while (current_offset < sb->head) {
         struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + current_offset);
 
-        if(log_entry->inode.inode_number > max_inode_number) {
+        // A crash can leave the superblock pointing past entries that never fully reached the disk. Only fsck.wfs can
+        // tell whether valid entries follow a bad one, so refuse to mount without touching the image
+        size_t entry_size = wfs_valid_log_entry_size(mapped_data, current_offset, sb->head);
+        if(entry_size == 0) {
+            fprintf(stderr, "Log entry at offset %ld doesn't match its checksum, run fsck.wfs on the disk image\n",
+                    (long)current_offset);
+            exit(EXIT_FAILURE);
+        }
+
+        if(log_entry->inode.deleted == 0) {
+            index_log_entry(log_entry);
+        }
+        else if(log_entry->inode.inode_number > max_inode_number) {
             max_inode_number = log_entry->inode.inode_number;
         }
 
-        current_offset += sizeof(struct wfs_log_entry) + log_entry->inode.size;
+        current_offset += entry_size;
     }
-    return max_inode_number;
 }
 
+// Helper function to give back an inode number whose log entries were all deleted so that it can be reused
+void release_inode_number(unsigned int inode_number) {
+    if(num_free_inodes == free_inodes_capacity) {
+        free_inodes_capacity = free_inodes_capacity > 0 ? free_inodes_capacity * 2 : 64;
+        free_inodes = realloc(free_inodes, free_inodes_capacity * sizeof(unsigned int));
+        if(free_inodes == NULL) {
+            perror("Error growing free inode list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free_inodes[num_free_inodes++] = inode_number;
+}
 
-static int wfs_getattr(const char *path, struct stat *stbuf) {
-    // Find latest log entry for the given path
-    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
-    
-    // Check if log entry exists
-    if(log_entry == NULL) {
-        return -ENOENT;
+// Helper function to pick the inode number of a new file or directory, reusing a free one if there is any
+unsigned int allocate_inode_number() {
+    if(num_free_inodes > 0) {
+        return free_inodes[--num_free_inodes];
     }
+    return max_inode_number + 1;
+}
 
-    // Update the stat structure
-    stbuf->st_ino = log_entry->inode.inode_number;
-    stbuf->st_mode = log_entry->inode.mode;
-    stbuf->st_nlink = log_entry->inode.links;
-    stbuf->st_uid = log_entry->inode.uid;
-    stbuf->st_gid = log_entry->inode.gid;
-    stbuf->st_size = log_entry->inode.size;
-    stbuf->st_mtime = log_entry->inode.mtime;
+// Helper function to find how many bytes of log a log entry of the given size takes up at most. On aligned images that
+// includes the padding that may go in front of it and the rounding of its data
+size_t log_space(size_t entry_size) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    size_t space = wfs_align(entry_size, sb->alignment);
+    if(sb->alignment > WFS_ALIGNMENT || sb->data_alignment != 0) {
+        space += sb->data_alignment + 2 * wfs_align(sizeof(struct wfs_log_entry), sb->alignment);
+    }
+    return space;
+}
+
+// Helper function to check if a log entry of the given size fits between the head of the log and the end of the disk
+int log_has_space(size_t entry_size) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    return sb->head + log_space(entry_size) <= disk_size;
+}
+
+// Helper function to grow the disk image to at least the given size and extend the mapping over it, returns -1 if the
+// disk image can't grow. Must be called with fs_lock held exclusively
+int grow_disk(off_t min_size) {
+    if(min_size > mapping_size) {
+        return -1;
+    }
+
+    // Double the disk image so that growing it is rare, but settle for what is needed if the host is short on space.
+    // Allocating the blocks up front turns running out of space on the host into an error here instead of a SIGBUS on
+    // a later write to the mapping
+    off_t new_size = disk_size;
+    while(new_size < min_size) {
+        new_size *= 2;
+    }
+    if(new_size > mapping_size) {
+        new_size = mapping_size;
+    }
+    if(posix_fallocate(fd, disk_size, new_size - disk_size) != 0) {
+        new_size = min_size;
+        if(posix_fallocate(fd, disk_size, new_size - disk_size) != 0) {
+            return -1;
+        }
+    }
+
+    // Map the grown file over the old mapping and the reserved address space after it. Pages of the file stay where they
+    // were, so pointers into the mapping remain valid
+    if(mmap(mapped_data, new_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("Error growing disk image mapping");
+        exit(EXIT_FAILURE);
+    }
+    disk_size = new_size;
     return 0;
 }
 
-static int wfs_mknod(const char *path, mode_t mode, dev_t device) {
-    // Find latest log entry for the given path
-    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+// Helper function to make room for a log entry of the given size at the head of the log, returns -1 if there is no space
+// for it. Reclaiming dead entries is preferred, so the disk image only grows once a cleaning pass left less than the
+// share of the disk the cleaner aims to keep free, or couldn't run because nothing was appended since the last one
+int reserve_log_space(size_t entry_size) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    if(log_has_space(entry_size)) {
+        return 0;
+    }
 
-    // Check if log entry already exists
-    if(log_entry != NULL) {
-        return -EEXIST;
+    pthread_mutex_lock(&cleaner_lock);
+    int cleaning_helps = cleaner_running && sb->head != cleaner_last_head &&
+                         disk_size - cleaner_last_head >= disk_size / CLEANER_FREE_FRACTION;
+    pthread_mutex_unlock(&cleaner_lock);
+    if(cleaning_helps) {
+        return -1;
     }
+    return grow_disk(sb->head + log_space(entry_size));
+}
 
-    // Separate filename and path to the directory that the file is located in
-    char path_copy[MAX_PATH_NAME_LEN];
-    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
-    struct wfs_path_info path_info;
-    separate_path_and_file(path_copy, &path_info);
+// Helper function to append a checkpoint of the inode index to the log, returns -1 if there is no space for it
+int write_checkpoint() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
 
-    // Find latest log entry for the parent directory
-    struct wfs_log_entry *parent_log_entry = find_log_entry_by_path(path_info.parent_path);
-    
-    // Check if parent log entry exists
-    if(parent_log_entry == NULL) {
-        return -ENOENT;
+    unsigned int num_inodes = 0;
+    unsigned int num_extents = 0;
+    for(int i = 0; i < inode_index_capacity; i++) {
+        if(inode_index[i].latest != -1) {
+            num_inodes++;
+            num_extents += inode_index[i].num_extents;
+        }
+    }
+
+    size_t payload_size = sizeof(struct wfs_checkpoint) + num_inodes * sizeof(struct wfs_imap_entry) +
+                          num_extents * sizeof(struct wfs_imap_extent);
+    if(!log_has_space(sizeof(struct wfs_log_entry) + payload_size)) {
+        return -1;
+    }
+
+    // Checkpoints are marked deleted so that every log scan skips over them
+    struct wfs_log_entry *checkpoint_entry = head_log_entry(0, 0);
+    off_t checkpoint_offset = (char *)checkpoint_entry - (char *)mapped_data;
+    memset(&checkpoint_entry->inode, 0, sizeof(struct wfs_inode));
+    checkpoint_entry->inode.deleted = 1;
+    checkpoint_entry->inode.flags = WFS_INODE_CHECKPOINT;
+    checkpoint_entry->inode.size = payload_size;
+    checkpoint_entry->inode.mtime = time(NULL);
+
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint *)checkpoint_entry->data;
+    checkpoint->max_inode_number = max_inode_number;
+    checkpoint->num_inodes = num_inodes;
+    checkpoint->num_extents = num_extents;
+    checkpoint->reserved = 0;
+
+    struct wfs_imap_entry *imap = (struct wfs_imap_entry *)checkpoint->data;
+    struct wfs_imap_extent *extents = (struct wfs_imap_extent *)&imap[num_inodes];
+    for(int i = 0; i < inode_index_capacity; i++) {
+        struct inode_info *info = &inode_index[i];
+        if(info->latest == -1) {
+            continue;
+        }
+        imap->inode_number = i;
+        imap->latest = info->latest;
+        imap->base = info->base != -1 ? info->base : 0;
+        imap->num_extents = info->num_extents;
+        imap++;
+        for(int j = 0; j < info->num_extents; j++) {
+            extents->file_offset = info->extents[j].file_offset;
+            extents->length = info->extents[j].length;
+            extents->entry_offset = info->extents[j].entry_offset;
+            extents->data_offset = info->extents[j].data_offset;
+            extents++;
+        }
     }
 
-    // Find the next inode number not in use to assign to the new file
-    int new_inode_number = find_max_inode_number() + 1;
+    // Only point the superblock at the checkpoint once it is complete
+    advance_head(checkpoint_entry);
+    sb->checkpoint = checkpoint_offset;
+    stat_add(&stats.checkpoints, 1);
+    return 0;
+}
+
+// Helper function to find how many bytes were appended to the log since the most recent checkpoint
+off_t checkpoint_age() {
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    
-    // Check if space exists in the log file system for this operation
-    if(sb->head + sizeof(struct wfs_log_entry) + parent_log_entry->inode.size + sizeof(struct wfs_dentry) > disk_size) {
-        return -ENOSPC;
-    } 
-     
-    // Construct new parent log entry containing the new file 
-    struct wfs_log_entry *new_parent_log_entry = (struct wfs_log_entry *)((char*)mapped_data + sb->head);
-    memcpy(new_parent_log_entry, parent_log_entry, sizeof(struct wfs_log_entry) + parent_log_entry->inode.size);
-    struct wfs_dentry *entries = (struct wfs_dentry *)new_parent_log_entry->data;
-    int num_entries = new_parent_log_entry->inode.size / sizeof(struct wfs_dentry);
-    memcpy(entries[num_entries].name, path_info.filename, MAX_FILE_NAME_LEN);
-    entries[num_entries].inode_number = new_inode_number;
-    new_parent_log_entry->inode.size += sizeof(struct wfs_dentry);
-    sb->head += sizeof(struct wfs_log_entry) + new_parent_log_entry->inode.size;
+    if(sb->checkpoint == 0) {
+        return sb->head;
+    }
+    struct wfs_log_entry *checkpoint_entry = (struct wfs_log_entry *)((char *)mapped_data + sb->checkpoint);
+    return sb->head - (sb->checkpoint + wfs_log_entry_size(checkpoint_entry, sb));
+}
 
-    // Check if space exists in the log file system for this operation
-    if(sb->head + sizeof(struct wfs_log_entry) > disk_size) {
-        return -ENOSPC;
+// Helper function to check if it is time for another periodic checkpoint. Waiting for at least as many bytes as the
+// previous checkpoint took up keeps checkpoints of large directories from filling the log
+int checkpoint_due() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    off_t age = checkpoint_age();
+    if(age < CHECKPOINT_INTERVAL_BYTES) {
+        return 0;
+    }
+    if(sb->checkpoint == 0) {
+        return 1;
     }
+    struct wfs_log_entry *checkpoint_entry = (struct wfs_log_entry *)((char *)mapped_data + sb->checkpoint);
+    return age >= wfs_log_entry_size(checkpoint_entry, sb);
+}
 
-    // Construct log entry for the new file
-    struct wfs_log_entry *new_entry = (struct wfs_log_entry *)((char*)mapped_data + sb->head);
-    new_entry->inode.inode_number = new_inode_number;
-    new_entry->inode.deleted = 0;
-    new_entry->inode.mode = __S_IFREG;
-    new_entry->inode.uid = getuid();
-    new_entry->inode.gid = getgid();
-    new_entry->inode.flags = 0;
-    new_entry->inode.size = 0;
-    new_entry->inode.atime = time(NULL);
-    new_entry->inode.mtime = time(NULL);
-    new_entry->inode.ctime = time(NULL);
+// Helper function to take the locks of an operation that appends to the log or moves entries in it. append_lock is held
+// for the whole operation, even while append_extent drops fs_lock to copy a large extent, so it is what keeps the log,
+// the inode index, the head and the write buffers from changing under the operation. Readers share fs_lock and change
+// none of them
+void lock_for_append() {
+    pthread_mutex_lock(&append_lock);
+    pthread_rwlock_wrlock(&fs_lock);
+}
+
+// Helper function to release the locks taken by lock_for_append
+void unlock_for_append() {
+    pthread_rwlock_unlock(&fs_lock);
+    pthread_mutex_unlock(&append_lock);
+}
+
+// Helper function to record that the log was modified in place at the given offset, which is behind the head and so
+// not covered by the appended range of the next commit
+void mark_log_dirty(off_t offset) {
+    if(offset < dirty_offset) {
+        dirty_offset = offset;
+    }
+}
+
+// Helper function to write the log from dirty_offset to the head and the superblock back to the disk image with fs_lock
+// held exclusively. The cleaner calls it before it pads or overwrites the old copy of an entry it moved, or an entry
+// made dead by one that might not be on the disk yet, so that a crash never takes the only copy on the disk. Exits if
+// the image can't be written, since no space can be reused safely after that
+void write_back_log() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t start = dirty_offset / page_size * page_size;
+    if((sb->head > start && msync((char *)mapped_data + start, sb->head - start, MS_SYNC) == -1) ||
+       msync(mapped_data, sizeof(struct wfs_sb), MS_SYNC) == -1) {
+        perror("Error writing back the log");
+        exit(EXIT_FAILURE);
+    }
+    dirty_offset = sb->head;
+}
+
+// Helper function to write the part of the log that changed since the last commit back to the disk image, returns -1 on
+// failure
+int commit_log() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    // Everything changed before this point lies between dirty_offset and the head, anything changed later is left to the
+    // next commit
+    pthread_rwlock_rdlock(&fs_lock);
+    off_t start = dirty_offset / page_size * page_size;
+    off_t end = sb->head;
+    dirty_offset = end;
+    pthread_rwlock_unlock(&fs_lock);
+
+    // Write the entries before the superblock so that the head on disk never points past entries that are not there
+    int res = 0;
+    if(end > start && msync((char *)mapped_data + start, end - start, MS_SYNC) == -1) {
+        res = -1;
+    }
+    if(res == 0 && msync(mapped_data, sizeof(struct wfs_sb), MS_SYNC) == -1) {
+        res = -1;
+    }
+
+    if(res == -1) {
+        pthread_rwlock_rdlock(&fs_lock);
+        mark_log_dirty(start);
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    return res;
+}
+
+// Helper function to make everything written to the log before the call durable, returns -1 on failure. Must be called
+// without holding fs_lock since committing needs it
+int sync_log() {
+    pthread_mutex_lock(&sync_lock);
+
+    // A commit already running may have started before the caller's writes, only one starting after now covers them
+    unsigned long target = syncs_started + 1;
+    int res = 0;
+    while(syncs_completed < target) {
+        if(sync_in_progress) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            continue;
+        }
+
+        sync_in_progress = 1;
+        unsigned long commit = ++syncs_started;
+        pthread_mutex_unlock(&sync_lock);
+        res = commit_log();
+        pthread_mutex_lock(&sync_lock);
+        sync_in_progress = 0;
+        if(res == 0) {
+            syncs_completed = commit;
+        }
+        pthread_cond_broadcast(&sync_cond);
+        if(res == -1) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&sync_lock);
+    return res;
+}
+
+// Helper function to append a tombstone removing an inode, which supersedes every entry of it written before. The
+// earlier entries are left as they are, the cleaner drops them along with the tombstone
+void append_tombstone(unsigned int inode_number) {
+    struct wfs_log_entry *tombstone = head_log_entry(0, 0);
+    memset(&tombstone->inode, 0, sizeof(struct wfs_inode));
+    tombstone->inode.inode_number = inode_number;
+    tombstone->inode.flags = WFS_INODE_TOMBSTONE;
+    tombstone->inode.ctime = time(NULL);
+
+    index_log_entry(tombstone);
+    advance_head(tombstone);
+}
+
+// Helper function to separate filename and path to the directory that the file is located in
+void separate_path_and_file(const char *path, struct wfs_path_info *info) {
+    const char *filename = strrchr(path, '/');
+
+    if (filename != NULL) {
+        filename++;
+
+        size_t path_len = filename - path - 1;
+
+        strncpy(info->parent_path, path, path_len);
+        info->parent_path[path_len] = '\0';
+
+        strncpy(info->filename, filename, MAX_FILE_NAME_LEN - 1);
+        info->filename[MAX_FILE_NAME_LEN - 1] = '\0';
+    } else {
+        strcpy(info->parent_path, "/");
+        strncpy(info->filename, path, MAX_FILE_NAME_LEN - 1);
+        info->filename[MAX_FILE_NAME_LEN - 1] = '\0';
+    }
+}
+
+// Helper function to find the most recent log entry for an inode number
+struct wfs_log_entry* find_latest_log_entry(unsigned int inode_number) {
+    if(inode_number >= inode_index_capacity || inode_index[inode_number].latest == -1) {
+        return NULL;
+    }
+    return (struct wfs_log_entry *)((char *)mapped_data + inode_index[inode_number].latest);
+}
+
+// Helper function to write the part of a literal or match length that doesn't fit in the 4 bits of the token
+unsigned char *write_length_bytes(unsigned char *out, size_t length) {
+    for(length -= 15; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+// Helper function to read back a length written by write_length_bytes, given the 4 bits of it in the token
+size_t read_length_bytes(const unsigned char **in, size_t length) {
+    if(length == 15) {
+        unsigned char byte;
+        do {
+            byte = *(*in)++;
+            length += byte;
+        } while(byte == 255);
+    }
+    return length;
+}
+
+// Helper function to append a sequence of literals followed by a match to compressed data. A match length of 0 writes the
+// last sequence, which has no match. Returns 0 if it doesn't fit before end
+int write_sequence(unsigned char **out, unsigned char *end, const unsigned char *literals, size_t num_literals, size_t distance, size_t match_length) {
+    size_t worst_case = 1 + num_literals / 255 + 1 + num_literals + (match_length > 0 ? 2 + match_length / 255 + 1 : 0);
+    if(worst_case > end - *out) {
+        return 0;
+    }
+
+    size_t match_code = match_length > 0 ? match_length - COMPRESS_MIN_MATCH : 0;
+    unsigned char *token = (*out)++;
+    *token = (num_literals < 15 ? num_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if(num_literals >= 15) {
+        *out = write_length_bytes(*out, num_literals);
+    }
+    memcpy(*out, literals, num_literals);
+    *out += num_literals;
+    if(match_length > 0) {
+        *(*out)++ = distance & 0xff;
+        *(*out)++ = distance >> 8;
+        if(match_code >= 15) {
+            *out = write_length_bytes(*out, match_code);
+        }
+    }
+    return 1;
+}
+
+// Helper function to compress data in the format of struct wfs_compressed, finding earlier occurrences of every 4 bytes
+// through a hash table. Returns the compressed length, or 0 if it doesn't fit in capacity bytes
+size_t compress_data(const char *data, size_t length, char *compressed, size_t capacity) {
+    size_t table[1 << COMPRESS_HASH_BITS];   // one past the last position of 4 bytes with each hash, 0 if none
+    memset(table, 0, sizeof(table));
+
+    const unsigned char *in = (const unsigned char *)data;
+    unsigned char *out = (unsigned char *)compressed;
+    unsigned char *end = out + capacity;
+    size_t anchor = 0;
+    size_t position = 0;
+    while(position + COMPRESS_MIN_MATCH <= length) {
+        uint32_t word;
+        memcpy(&word, in + position, sizeof(word));
+        unsigned int hash = (word * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = position + 1;
+
+        if(candidate == 0 || position - (candidate - 1) > COMPRESS_MAX_DISTANCE || memcmp(in + candidate - 1, in + position, COMPRESS_MIN_MATCH) != 0) {
+            // Skip ahead faster the longer nothing matches, so that incompressible data goes by quickly
+            position += 1 + ((position - anchor) >> 6);
+            continue;
+        }
+        candidate--;
+
+        size_t match_length = COMPRESS_MIN_MATCH;
+        while(position + match_length < length && in[candidate + match_length] == in[position + match_length]) {
+            match_length++;
+        }
+        if(!write_sequence(&out, end, in + anchor, position - anchor, position - candidate, match_length)) {
+            return 0;
+        }
+        position += match_length;
+        anchor = position;
+    }
+    if(!write_sequence(&out, end, in + anchor, length - anchor, 0, 0)) {
+        return 0;
+    }
+    return out - (unsigned char *)compressed;
+}
+
+// Helper function to decompress data written by compress_data
+void decompress_data(const char *compressed, size_t compressed_length, char *data) {
+    const unsigned char *in = (const unsigned char *)compressed;
+    const unsigned char *end = in + compressed_length;
+    unsigned char *out = (unsigned char *)data;
+    while(in < end) {
+        unsigned char token = *in++;
+        size_t num_literals = read_length_bytes(&in, token >> 4);
+        memcpy(out, in, num_literals);
+        out += num_literals;
+        in += num_literals;
+        if(in >= end) {
+            break;
+        }
+
+        size_t distance = in[0] | in[1] << 8;
+        in += 2;
+        size_t match_length = read_length_bytes(&in, token & 0xf) + COMPRESS_MIN_MATCH;
+
+        // Matches may overlap the bytes they produce, so copy one byte at a time
+        const unsigned char *match = out - distance;
+        for(size_t i = 0; i < match_length; i++) {
+            out[i] = match[i];
+        }
+        out += match_length;
+    }
+}
+
+// Helper function to empty the cache of decompressed log entries, called with fs_lock held exclusively before entries
+// move to where others used to be
+void clear_decompress_cache() {
+    for(int i = 0; i < DECOMPRESS_CACHE_SLOTS; i++) {
+        free(decompress_cache[i].data);
+        decompress_cache[i].data = NULL;
+        decompress_cache[i].entry_offset = -1;
+    }
+}
+
+// Helper function to copy bytes of the file data stored at data within a log entry, length bytes once decompressed
+void copy_entry_data(struct wfs_log_entry *log_entry, const char *data, size_t length, char *buffer, size_t count, size_t data_offset) {
+    if(!(log_entry->inode.flags & WFS_INODE_COMPRESSED)) {
+        memcpy(buffer, data + data_offset, count);
+        return;
+    }
+
+    off_t entry_offset = (char *)log_entry - (char *)mapped_data;
+    pthread_mutex_lock(&decompress_cache_lock);
+    for(int i = 0; i < DECOMPRESS_CACHE_SLOTS; i++) {
+        if(decompress_cache[i].entry_offset == entry_offset) {
+            memcpy(buffer, decompress_cache[i].data + data_offset, count);
+            decompress_cache[i].last_used = ++decompress_cache_clock;
+            pthread_mutex_unlock(&decompress_cache_lock);
+            stat_add(&stats.decompress_hits, 1);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&decompress_cache_lock);
+    stat_add(&stats.decompress_misses, 1);
+
+    // Decompress without holding the cache lock so that readers of other entries aren't held up
+    struct wfs_compressed *compressed = (struct wfs_compressed *)data;
+    char *decompressed = malloc(length);
+    if(decompressed == NULL) {
+        perror("Error allocating decompressed data");
+        exit(EXIT_FAILURE);
+    }
+    decompress_data(compressed->data, compressed->length, decompressed);
+    memcpy(buffer, decompressed + data_offset, count);
+
+    // Replace the least recently used slot, unless another reader cached the same entry in the meantime
+    pthread_mutex_lock(&decompress_cache_lock);
+    int victim = 0;
+    for(int i = 0; i < DECOMPRESS_CACHE_SLOTS; i++) {
+        if(decompress_cache[i].entry_offset == entry_offset) {
+            victim = -1;
+            break;
+        }
+        if(decompress_cache[i].last_used < decompress_cache[victim].last_used) {
+            victim = i;
+        }
+    }
+    if(victim != -1) {
+        free(decompress_cache[victim].data);
+        decompress_cache[victim].entry_offset = entry_offset;
+        decompress_cache[victim].data = decompressed;
+        decompress_cache[victim].last_used = ++decompress_cache_clock;
+    }
+    else {
+        free(decompressed);
+    }
+    pthread_mutex_unlock(&decompress_cache_lock);
+}
+
+// Helper function to store length bytes of file data at data within a log entry being appended, compressed if -o compress
+// is set and that makes it smaller. The space for the bytes as they are must be available
+void store_entry_data(struct wfs_log_entry *log_entry, char *data, const char *buffer, size_t length) {
+    log_entry->inode.flags &= ~WFS_INODE_COMPRESSED;
+    if(options.compress && length >= COMPRESS_MIN_SIZE) {
+        struct wfs_compressed *compressed = (struct wfs_compressed *)data;
+        size_t compressed_length = compress_data(buffer, length, compressed->data, length - sizeof(struct wfs_compressed) - 1);
+        if(compressed_length > 0) {
+            compressed->length = compressed_length;
+            log_entry->inode.flags |= WFS_INODE_COMPRESSED;
+            return;
+        }
+    }
+    memcpy(data, buffer, length);
+}
+
+// Helper function to fill the table of the rolling hash that finds chunk boundaries. It only needs to look random and
+// stay the same between mounts so that identical data is split the same way
+void init_chunk_gear() {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for(int i = 0; i < 256; i++) {
+        uint64_t value = (state += 0x9e3779b97f4a7c15ULL);
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        chunk_gear[i] = value ^ (value >> 31);
+    }
+}
+
+// Helper function to find the length of the chunk at the start of a buffer. Boundaries depend only on the bytes just
+// before them, so data shifted within a file is still split into the same chunks
+size_t next_chunk_length(const char *data, size_t length) {
+    if(length <= CHUNK_MIN_SIZE) {
+        return length;
+    }
+    size_t max_length = length < CHUNK_MAX_SIZE ? length : CHUNK_MAX_SIZE;
+    uint64_t mask = ((1ULL << CHUNK_AVG_BITS) - 1) << (64 - CHUNK_AVG_BITS);
+    uint64_t hash = 0;
+    for(size_t i = 0; i < max_length; i++) {
+        hash = (hash << 1) + chunk_gear[(unsigned char)data[i]];
+        if(i >= CHUNK_MIN_SIZE && (hash & mask) == 0) {
+            return i + 1;
+        }
+    }
+    return max_length;
+}
+
+// Helper function to hash the data of a chunk
+uint64_t chunk_hash(const char *data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Helper function to add a chunk log entry to the chunk index
+void chunk_index_add(uint64_t hash, unsigned int inode_number) {
+    if(num_chunks == chunks_capacity) {
+        chunks_capacity = chunks_capacity > 0 ? chunks_capacity * 2 : CHUNK_INDEX_MIN_BUCKETS;
+        chunk_entries = realloc(chunk_entries, chunks_capacity * sizeof(struct chunk_index_entry));
+        if(chunk_entries == NULL) {
+            perror("Error growing chunk index");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Keep at most one chunk per bucket on average
+    if(num_chunks >= num_chunk_buckets) {
+        int new_num_buckets = num_chunk_buckets > 0 ? num_chunk_buckets * 2 : CHUNK_INDEX_MIN_BUCKETS;
+        int *buckets = malloc(new_num_buckets * sizeof(int));
+        if(buckets == NULL) {
+            perror("Error growing chunk index");
+            exit(EXIT_FAILURE);
+        }
+        free(chunk_buckets);
+        chunk_buckets = buckets;
+        num_chunk_buckets = new_num_buckets;
+        for(int i = 0; i < num_chunk_buckets; i++) {
+            chunk_buckets[i] = -1;
+        }
+        for(int i = 0; i < num_chunks; i++) {
+            int bucket = chunk_entries[i].hash & (num_chunk_buckets - 1);
+            chunk_entries[i].next = chunk_buckets[bucket];
+            chunk_buckets[bucket] = i;
+        }
+    }
+
+    int bucket = hash & (num_chunk_buckets - 1);
+    chunk_entries[num_chunks].hash = hash;
+    chunk_entries[num_chunks].inode_number = inode_number;
+    chunk_entries[num_chunks].next = chunk_buckets[bucket];
+    chunk_buckets[bucket] = num_chunks;
+    num_chunks++;
+}
+
+// Helper function to find a stored chunk holding exactly the given bytes, returns its inode number or -1 if there is none
+long chunk_index_find(uint64_t hash, const char *data, size_t length) {
+    if(num_chunk_buckets == 0) {
+        return -1;
+    }
+    for(int i = chunk_buckets[hash & (num_chunk_buckets - 1)]; i != -1; i = chunk_entries[i].next) {
+        if(chunk_entries[i].hash != hash) {
+            continue;
+        }
+        // Hashes can collide, so only the bytes themselves decide
+        struct wfs_log_entry *chunk_entry = find_latest_log_entry(chunk_entries[i].inode_number);
+        struct wfs_chunk *chunk = (struct wfs_chunk *)chunk_entry->data;
+        if(chunk_entry->inode.size != length) {
+            continue;
+        }
+        if(!(chunk_entry->inode.flags & WFS_INODE_COMPRESSED)) {
+            if(memcmp(chunk->data, data, length) == 0) {
+                return chunk_entries[i].inode_number;
+            }
+            continue;
+        }
+        char *chunk_data = malloc(length);
+        if(chunk_data == NULL) {
+            perror("Error allocating chunk data");
+            exit(EXIT_FAILURE);
+        }
+        copy_entry_data(chunk_entry, chunk->data, length, chunk_data, length, 0);
+        int same = memcmp(chunk_data, data, length) == 0;
+        free(chunk_data);
+        if(same) {
+            return chunk_entries[i].inode_number;
+        }
+    }
+    return -1;
+}
+
+// Helper function to rebuild the chunk index from the chunk log entries in the inode index
+void build_chunk_index() {
+    num_chunks = 0;
+    for(int i = 0; i < num_chunk_buckets; i++) {
+        chunk_buckets[i] = -1;
+    }
+    for(int i = 0; i < inode_index_capacity; i++) {
+        struct wfs_log_entry *log_entry = find_latest_log_entry(i);
+        if(log_entry != NULL && (log_entry->inode.flags & WFS_INODE_CHUNK)) {
+            chunk_index_add(((struct wfs_chunk *)log_entry->data)->hash, i);
+        }
+    }
+}
+
+// Helper function to find how many bytes of log storing a buffer as chunks takes up at most
+size_t chunked_data_size(const char *buffer, size_t size) {
+    size_t entry_size = 0;
+    size_t num_refs = 0;
+    for(size_t position = 0; position < size; num_refs++) {
+        size_t length = next_chunk_length(buffer + position, size - position);
+        if(chunk_index_find(chunk_hash(buffer + position, length), buffer + position, length) == -1) {
+            entry_size += log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_chunk) + length);
+        }
+        position += length;
+    }
+    return entry_size + log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_chunk_list) + num_refs * sizeof(struct wfs_chunk_ref));
+}
+
+// Helper function to append the chunks of a buffer that aren't stored yet, followed by a chunked log entry with the given
+// inode referencing all of them. The space chunked_data_size asks for must be available
+void append_chunked_data(const struct wfs_inode *inode, const char *buffer, size_t size, off_t offset) {
+    size_t refs_capacity = size / CHUNK_MIN_SIZE + 1;
+    struct wfs_chunk_ref *refs = malloc(refs_capacity * sizeof(struct wfs_chunk_ref));
+    if(refs == NULL) {
+        perror("Error allocating chunk references");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t num_refs = 0;
+    for(size_t position = 0; position < size; num_refs++) {
+        size_t length = next_chunk_length(buffer + position, size - position);
+        uint64_t hash = chunk_hash(buffer + position, length);
+        long chunk_inode_number = chunk_index_find(hash, buffer + position, length);
+
+        // Store chunks seen for the first time as log entries of their own, with an inode number of their own
+        stat_add(chunk_inode_number == -1 ? &stats.chunk_misses : &stats.chunk_hits, 1);
+        if(chunk_inode_number == -1) {
+            chunk_inode_number = allocate_inode_number();
+            struct wfs_log_entry *chunk_entry = head_log_entry(sizeof(struct wfs_log_entry) + sizeof(struct wfs_chunk), length);
+            memset(&chunk_entry->inode, 0, sizeof(struct wfs_inode));
+            chunk_entry->inode.inode_number = chunk_inode_number;
+            chunk_entry->inode.uid = inode->uid;
+            chunk_entry->inode.gid = inode->gid;
+            chunk_entry->inode.flags = WFS_INODE_CHUNK;
+            chunk_entry->inode.size = length;
+            chunk_entry->inode.mtime = time(NULL);
+            chunk_entry->inode.links = 1;
+            struct wfs_chunk *chunk = (struct wfs_chunk *)chunk_entry->data;
+            chunk->hash = hash;
+            store_entry_data(chunk_entry, chunk->data, buffer + position, length);
+
+            index_log_entry(chunk_entry);
+            advance_head(chunk_entry);
+            chunk_index_add(hash, chunk_inode_number);
+        }
+
+        refs[num_refs].offset = position;
+        refs[num_refs].inode_number = chunk_inode_number;
+        refs[num_refs].length = length;
+        position += length;
+    }
+
+    struct wfs_log_entry *new_entry = head_log_entry(0, 0);
+    memcpy(&new_entry->inode, inode, sizeof(struct wfs_inode));
+    new_entry->inode.flags |= WFS_INODE_CHUNKED;
+    struct wfs_chunk_list *list = (struct wfs_chunk_list *)new_entry->data;
+    list->offset = offset;
+    list->length = size;
+    list->num_chunks = num_refs;
+    memcpy(list->chunks, refs, num_refs * sizeof(struct wfs_chunk_ref));
+    free(refs);
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+}
+
+// Helper function to record the chunks a log entry references, if it is a chunked one. Chunks fsck.wfs dropped along
+// with a bad span of the log are still referenced, so their numbers count as taken
+void mark_chunk_refs(struct wfs_log_entry *log_entry, unsigned char *referenced) {
+    if(!(log_entry->inode.flags & WFS_INODE_CHUNKED)) {
+        return;
+    }
+    struct wfs_chunk_list *list = (struct wfs_chunk_list *)log_entry->data;
+    for(uint64_t i = 0; i < list->num_chunks; i++) {
+        if(list->chunks[i].inode_number < inode_index_capacity) {
+            referenced[list->chunks[i].inode_number] = 1;
+        }
+        if(list->chunks[i].inode_number > max_inode_number) {
+            max_inode_number = list->chunks[i].inode_number;
+        }
+    }
+}
+
+// Helper function to find the chunks referenced by live log entries, returns a flag for every inode number of the index
+unsigned char *find_referenced_chunks() {
+    unsigned char *referenced = calloc(inode_index_capacity, 1);
+    if(referenced == NULL) {
+        perror("Error allocating chunk marks");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < inode_index_capacity; i++) {
+        struct inode_info *info = &inode_index[i];
+        if(info->latest == -1 || info->dir != NULL) {
+            continue;
+        }
+        if(info->base != -1) {
+            mark_chunk_refs((struct wfs_log_entry *)((char *)mapped_data + info->base), referenced);
+        }
+        for(int j = 0; j < info->num_extents; j++) {
+            mark_chunk_refs((struct wfs_log_entry *)((char *)mapped_data + info->extents[j].entry_offset), referenced);
+        }
+    }
+    return referenced;
+}
+
+// Helper function to find the inode numbers up to max_inode_number without a live log entry once the index is built.
+// Numbers of chunks that live chunk lists still reference are kept even if the chunk is gone, or a new file reusing
+// one would be read in place of the chunk
+void build_free_inode_list() {
+    unsigned char *referenced = find_referenced_chunks();
+
+    // Push in descending order so that the lowest numbers are handed out first
+    for(unsigned int i = max_inode_number; i > ROOT_INODE_NUMBER; i--) {
+        if(i >= inode_index_capacity || (inode_index[i].latest == -1 && !referenced[i])) {
+            release_inode_number(i);
+        }
+    }
+    free(referenced);
+}
+
+// Helper function to delete the chunks that no live log entry references any more and rebuild the chunk index
+void collect_chunks() {
+    if(num_chunks == 0) {
+        return;
+    }
+
+    unsigned char *referenced = find_referenced_chunks();
+    for(int i = 0; i < inode_index_capacity; i++) {
+        struct wfs_log_entry *log_entry = find_latest_log_entry(i);
+        if(log_entry != NULL && (log_entry->inode.flags & WFS_INODE_CHUNK) && !referenced[i]) {
+            log_entry->inode.deleted = 1;
+            mark_log_dirty(inode_index[i].latest);
+            clear_inode_info(i);
+            release_inode_number(i);
+        }
+    }
+    free(referenced);
+    build_chunk_index();
+}
+
+// Helper function to find the reference to the chunk holding a byte of the data of a chunked log entry
+int find_chunk_ref(struct wfs_chunk_list *list, size_t data_offset) {
+    int low = 0;
+    int high = list->num_chunks - 1;
+    while(low < high) {
+        int mid = (low + high + 1) / 2;
+        if(list->chunks[mid].offset <= data_offset) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// Helper function to find the chunk log entry a chunk reference points at. Returns NULL if there is no chunk of the
+// referenced length under its number, when fsck.wfs dropped the chunk along with a bad span of the log, in which case
+// its bytes read as zeros
+struct wfs_log_entry *find_chunk_entry(struct wfs_chunk_ref *ref) {
+    struct wfs_log_entry *chunk_entry = find_latest_log_entry(ref->inode_number);
+    if(chunk_entry == NULL || !(chunk_entry->inode.flags & WFS_INODE_CHUNK) || chunk_entry->inode.size != ref->length) {
+        return NULL;
+    }
+    return chunk_entry;
+}
+
+// Helper function to copy bytes out of the data of a whole-file or extent log entry, following the chunk references of
+// chunked ones
+void read_entry_data(struct wfs_log_entry *log_entry, char *buffer, size_t length, size_t data_offset) {
+    if(log_entry->inode.flags & WFS_INODE_EXTENT && !(log_entry->inode.flags & WFS_INODE_CHUNKED)) {
+        // Empty extents only cover the part of base a truncate cut off, which reads as zeros
+        struct wfs_extent *extent = (struct wfs_extent *)log_entry->data;
+        if(extent->length == 0) {
+            memset(buffer, 0, length);
+            return;
+        }
+        copy_entry_data(log_entry, extent->data, extent->length, buffer, length, data_offset);
+        return;
+    }
+    if(!(log_entry->inode.flags & WFS_INODE_CHUNKED)) {
+        copy_entry_data(log_entry, log_entry->data, log_entry->inode.size, buffer, length, data_offset);
+        return;
+    }
+
+    // Find the chunk holding the first byte, then copy one chunk after another
+    struct wfs_chunk_list *list = (struct wfs_chunk_list *)log_entry->data;
+    for(int i = find_chunk_ref(list, data_offset); length > 0; i++) {
+        struct wfs_chunk_ref *ref = &list->chunks[i];
+        struct wfs_log_entry *chunk_entry = find_chunk_entry(ref);
+        size_t start = data_offset - ref->offset;
+        size_t chunk_length = ref->length - start < length ? ref->length - start : length;
+        if(chunk_entry == NULL) {
+            memset(buffer, 0, chunk_length);
+        }
+        else {
+            struct wfs_chunk *chunk = (struct wfs_chunk *)chunk_entry->data;
+            copy_entry_data(chunk_entry, chunk->data, ref->length, buffer, chunk_length, start);
+        }
+        buffer += chunk_length;
+        data_offset += chunk_length;
+        length -= chunk_length;
+    }
+}
+
+// Helper function to copy part of a file out of its most recent whole-file log entry and the extents written after it
+void read_file_data(unsigned int inode_number, char *buffer, size_t size, off_t offset) {
+    struct inode_info *info = &inode_index[inode_number];
+
+    // Bytes not covered by any log entry read as zeros
+    memset(buffer, 0, size);
+
+    if(info->base != -1) {
+        struct wfs_log_entry *base = (struct wfs_log_entry *)((char *)mapped_data + info->base);
+        if(offset < base->inode.size) {
+            size_t length = base->inode.size - offset < size ? base->inode.size - offset : size;
+            read_entry_data(base, buffer, length, offset);
+        }
+    }
+
+    // Overlay the ranges of the extent map that intersect the requested bytes
+    for(int i = find_extent(info, offset); i < info->num_extents && info->extents[i].file_offset < offset + size; i++) {
+        struct extent_ref *range = &info->extents[i];
+        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + range->entry_offset);
+
+        off_t start = range->file_offset > offset ? range->file_offset : offset;
+        off_t end = range->file_offset + range->length < offset + size ? range->file_offset + range->length : offset + size;
+        read_entry_data(log_entry, buffer + (start - offset), end - start, range->data_offset + (start - range->file_offset));
+    }
+}
+
+// Helper function to find the pins of the calling thread, creating them on its first read_buf
+struct read_pins *thread_read_pins() {
+    struct read_pins *pins = pthread_getspecific(read_pins_key);
+    if(pins != NULL) {
+        return pins;
+    }
+    pins = calloc(1, sizeof(struct read_pins));
+    if(pins == NULL) {
+        perror("Error allocating read pins");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&read_pins_lock);
+    pins->next = read_pins;
+    if(read_pins != NULL) {
+        read_pins->prev = pins;
+    }
+    read_pins = pins;
+    pthread_mutex_unlock(&read_pins_lock);
+    pthread_setspecific(read_pins_key, pins);
+    return pins;
+}
+
+// Helper function to drop the pins of a thread that exits, called by pthread through read_pins_key
+void free_read_pins(void *arg) {
+    struct read_pins *pins = arg;
+    pthread_mutex_lock(&read_pins_lock);
+    if(pins->prev != NULL) {
+        pins->prev->next = pins->next;
+    }
+    else {
+        read_pins = pins->next;
+    }
+    if(pins->next != NULL) {
+        pins->next->prev = pins->prev;
+    }
+    pthread_mutex_unlock(&read_pins_lock);
+    free(pins->ranges);
+    free(pins);
+}
+
+// Helper function to keep the cleaner from moving entries over a range of the disk image a reply of the calling thread
+// refers to. Must be called with fs_lock held shared
+void pin_log_range(off_t start, off_t end) {
+    struct read_pins *pins = thread_read_pins();
+    pthread_mutex_lock(&read_pins_lock);
+    if(pins->num_ranges > 0 && pins->ranges[2 * pins->num_ranges - 1] == start) {
+        pins->ranges[2 * pins->num_ranges - 1] = end;
+        pthread_mutex_unlock(&read_pins_lock);
+        return;
+    }
+    if(pins->num_ranges == pins->ranges_capacity) {
+        pins->ranges_capacity = pins->ranges_capacity > 0 ? pins->ranges_capacity * 2 : 8;
+        pins->ranges = realloc(pins->ranges, 2 * pins->ranges_capacity * sizeof(off_t));
+        if(pins->ranges == NULL) {
+            perror("Error growing read pins");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pins->ranges[2 * pins->num_ranges] = start;
+    pins->ranges[2 * pins->num_ranges + 1] = end;
+    pins->num_ranges++;
+    pthread_mutex_unlock(&read_pins_lock);
+}
+
+// Helper function to release the ranges pinned by the previous read_buf of the calling thread, whose reply is sent
+void unpin_log_ranges() {
+    struct read_pins *pins = pthread_getspecific(read_pins_key);
+    if(pins == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&read_pins_lock);
+    pins->num_ranges = 0;
+    pthread_mutex_unlock(&read_pins_lock);
+}
+
+// Helper function for the cleaner to copy the ranges pinned by every thread, returns how many there are
+int collect_read_pins(off_t **ranges) {
+    pthread_mutex_lock(&read_pins_lock);
+    int count = 0;
+    for(struct read_pins *pins = read_pins; pins != NULL; pins = pins->next) {
+        count += pins->num_ranges;
+    }
+    *ranges = malloc((2 * count + 1) * sizeof(off_t));
+    if(*ranges == NULL) {
+        perror("Error allocating read pins");
+        exit(EXIT_FAILURE);
+    }
+    count = 0;
+    for(struct read_pins *pins = read_pins; pins != NULL; pins = pins->next) {
+        memcpy(*ranges + 2 * count, pins->ranges, 2 * pins->num_ranges * sizeof(off_t));
+        count += pins->num_ranges;
+    }
+    pthread_mutex_unlock(&read_pins_lock);
+    return count;
+}
+
+// Helper function to check if any of the pinned ranges overlaps the bytes of the disk image between two offsets
+int log_range_pinned(const off_t *ranges, int num_ranges, off_t start, off_t end) {
+    for(int i = 0; i < num_ranges; i++) {
+        if(ranges[2 * i] < end && start < ranges[2 * i + 1]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to add a buffer to the end of a vector for read_buf, extending the last buffer instead when both refer
+// to adjacent bytes of the disk image
+struct fuse_bufvec *append_buf(struct fuse_bufvec *vec, const struct fuse_buf *buf) {
+    if(vec->count > 0) {
+        struct fuse_buf *last = &vec->buf[vec->count - 1];
+        if((last->flags & FUSE_BUF_IS_FD) && (buf->flags & FUSE_BUF_IS_FD) && last->pos + last->size == buf->pos) {
+            last->size += buf->size;
+            return vec;
+        }
+    }
+
+    // struct fuse_bufvec has room for one buffer of its own
+    vec = realloc(vec, sizeof(struct fuse_bufvec) + vec->count * sizeof(struct fuse_buf));
+    if(vec == NULL) {
+        perror("Error growing read buffer vector");
+        exit(EXIT_FAILURE);
+    }
+    vec->buf[vec->count++] = *buf;
+    return vec;
+}
+
+// Helper function to add a zeroed buffer of memory to a vector for read_buf, which libfuse frees once the reply is sent
+struct fuse_bufvec *append_mem_buf(struct fuse_bufvec *vec, size_t size, char **mem) {
+    struct fuse_buf buf = { .size = size, .flags = 0, .mem = calloc(1, size), .fd = -1, .pos = 0 };
+    if(buf.mem == NULL) {
+        perror("Error allocating read buffer");
+        exit(EXIT_FAILURE);
+    }
+    *mem = buf.mem;
+    return append_buf(vec, &buf);
+}
+
+// Helper function to add bytes of the file data stored at data within a log entry, length bytes once decompressed, to a
+// vector for read_buf. Bytes stored as they are are referred to within the disk image and pinned instead of being copied
+struct fuse_bufvec *append_entry_data_buf(struct fuse_bufvec *vec, struct wfs_log_entry *log_entry, const char *data, size_t length, size_t count, size_t data_offset) {
+    if(log_entry->inode.flags & WFS_INODE_COMPRESSED) {
+        char *mem;
+        vec = append_mem_buf(vec, count, &mem);
+        copy_entry_data(log_entry, data, length, mem, count, data_offset);
+        return vec;
+    }
+    struct fuse_buf buf = {
+        .size = count,
+        .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY,
+        .mem = NULL,
+        .fd = fd,
+        .pos = data - (char *)mapped_data + data_offset,
+    };
+    pin_log_range(buf.pos, buf.pos + count);
+    return append_buf(vec, &buf);
+}
+
+// Helper function to add bytes out of the data of a whole-file or extent log entry to a vector for read_buf, the same
+// bytes read_entry_data copies
+struct fuse_bufvec *append_file_entry_buf(struct fuse_bufvec *vec, struct wfs_log_entry *log_entry, size_t length, size_t data_offset) {
+    if(log_entry->inode.flags & WFS_INODE_EXTENT && !(log_entry->inode.flags & WFS_INODE_CHUNKED)) {
+        struct wfs_extent *extent = (struct wfs_extent *)log_entry->data;
+        if(extent->length == 0) {
+            char *mem;
+            return append_mem_buf(vec, length, &mem);
+        }
+        return append_entry_data_buf(vec, log_entry, extent->data, extent->length, length, data_offset);
+    }
+    if(!(log_entry->inode.flags & WFS_INODE_CHUNKED)) {
+        return append_entry_data_buf(vec, log_entry, log_entry->data, log_entry->inode.size, length, data_offset);
+    }
+
+    struct wfs_chunk_list *list = (struct wfs_chunk_list *)log_entry->data;
+    for(int i = find_chunk_ref(list, data_offset); length > 0; i++) {
+        struct wfs_chunk_ref *ref = &list->chunks[i];
+        struct wfs_log_entry *chunk_entry = find_chunk_entry(ref);
+        size_t start = data_offset - ref->offset;
+        size_t chunk_length = ref->length - start < length ? ref->length - start : length;
+        if(chunk_entry == NULL) {
+            char *mem;
+            vec = append_mem_buf(vec, chunk_length, &mem);
+        }
+        else {
+            struct wfs_chunk *chunk = (struct wfs_chunk *)chunk_entry->data;
+            vec = append_entry_data_buf(vec, chunk_entry, chunk->data, ref->length, chunk_length, start);
+        }
+        data_offset += chunk_length;
+        length -= chunk_length;
+    }
+    return vec;
+}
+
+// Helper function to add bytes of a file not covered by its extent map to a vector for read_buf, taken from its most
+// recent whole-file log entry or zeros past its end
+struct fuse_bufvec *append_base_buf(struct fuse_bufvec *vec, struct inode_info *info, off_t offset, size_t size) {
+    if(info->base != -1) {
+        struct wfs_log_entry *base = (struct wfs_log_entry *)((char *)mapped_data + info->base);
+        if(offset < base->inode.size) {
+            size_t length = base->inode.size - offset < size ? base->inode.size - offset : size;
+            vec = append_file_entry_buf(vec, base, length, offset);
+            offset += length;
+            size -= length;
+        }
+    }
+    if(size > 0) {
+        char *mem;
+        vec = append_mem_buf(vec, size, &mem);
+    }
+    return vec;
+}
+
+// Helper function to allocate an empty vector of buffers for read_buf
+struct fuse_bufvec *new_bufvec() {
+    struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec));
+    if(vec == NULL) {
+        perror("Error allocating read buffer vector");
+        exit(EXIT_FAILURE);
+    }
+    vec->count = 0;
+    vec->idx = 0;
+    vec->off = 0;
+    return vec;
+}
+
+// Helper function to describe part of a file as a vector of buffers for read_buf, walking the same log entries as
+// read_file_data
+struct fuse_bufvec *build_file_bufvec(unsigned int inode_number, size_t size, off_t offset) {
+    struct inode_info *info = &inode_index[inode_number];
+    struct fuse_bufvec *vec = new_bufvec();
+
+    // Alternate between the gaps of the extent map and the ranges of it that intersect the requested bytes
+    off_t position = offset;
+    off_t end = offset + size;
+    for(int i = find_extent(info, offset); i < info->num_extents && info->extents[i].file_offset < end; i++) {
+        struct extent_ref *range = &info->extents[i];
+        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + range->entry_offset);
+
+        off_t start = range->file_offset > offset ? range->file_offset : offset;
+        off_t stop = range->file_offset + range->length < end ? range->file_offset + range->length : end;
+        if(position < start) {
+            vec = append_base_buf(vec, info, position, start - position);
+        }
+        vec = append_file_entry_buf(vec, log_entry, stop - start, range->data_offset + (start - range->file_offset));
+        position = stop;
+    }
+    if(position < end) {
+        vec = append_base_buf(vec, info, position, end - position);
+    }
+    return vec;
+}
+
+// Helper function to find the inode number a name resolves to within a directory (-1 if it doesn't exist)
+long lookup_dentry(struct wfs_log_entry *dir_log_entry, const char *name) {
+    struct inode_info *info = &inode_index[dir_log_entry->inode.inode_number];
+
+    // Names that don't fit in a dentry can never exist
+    if(info->dir == NULL || strlen(name) >= MAX_FILE_NAME_LEN) {
+        return -1;
+    }
+
+    int index = dir_find(info->dir, name);
+    if(index == -1 || find_latest_log_entry(info->dir->dentries[index].inode_number) == NULL) {
+        stat_add(&stats.dentry_misses, 1);
+        return -1;
+    }
+    stat_add(&stats.dentry_hits, 1);
+    return info->dir->dentries[index].inode_number;
+}
+
+// Helper function to find the most recent log entry for a given path
+struct wfs_log_entry* find_log_entry_by_path(const char *path) {
+    struct wfs_log_entry *log_entry = find_latest_log_entry(ROOT_INODE_NUMBER);
+
+    char *token, *saveptr;
+    char path_copy[MAX_PATH_NAME_LEN];
+    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
+    path_copy[MAX_PATH_NAME_LEN - 1] = '\0';
+
+    token = strtok_r(path_copy, "/", &saveptr);
+
+    // Resolve one path component at a time starting from the root directory
+    while (token != NULL && log_entry != NULL) {
+        if (!S_ISDIR(log_entry->inode.mode)) {
+            return NULL;
+        }
+
+        long inode_number = lookup_dentry(log_entry, token);
+        if(inode_number == -1) {
+            return NULL;
+        }
+
+        log_entry = find_latest_log_entry(inode_number);
+        token = strtok_r(NULL, "/", &saveptr);
+    }
+    return log_entry;
+}
+
+
+// Helper function to check if a log entry is still part of the current state of its inode
+int is_live_log_entry(struct wfs_log_entry *log_entry, off_t offset) {
+    unsigned int inode_number = log_entry->inode.inode_number;
+    if(log_entry->inode.deleted == 1 || inode_number >= inode_index_capacity) {
+        return 0;
+    }
+
+    // Every entry before a tombstone has been looked at by the time the cleaner reaches it, and the ones it removed
+    // were dropped, so the tombstone itself is no longer needed
+    if(log_entry->inode.flags & WFS_INODE_TOMBSTONE) {
+        return 0;
+    }
+
+    // The most recent entry holds the inode even if it changed nothing else, like a truncate or new times
+    struct inode_info *info = &inode_index[inode_number];
+    if(info->base == offset || info->latest == offset) {
+        return 1;
+    }
+    if(log_entry->inode.flags & WFS_INODE_DENTRY) {
+        return find_dentry_update(info, offset) != -1;
+    }
+    for(int i = 0; i < info->num_extents; i++) {
+        if(info->extents[i].entry_offset == offset) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to point the inode index at the new location of a log entry moved by the cleaner
+void relocate_log_entry(unsigned int inode_number, off_t old_offset, off_t new_offset) {
+    struct inode_info *info = &inode_index[inode_number];
+    if(info->latest == old_offset) {
+        info->latest = new_offset;
+    }
+    if(info->base == old_offset) {
+        info->base = new_offset;
+    }
+
+    // Entries only ever slide towards the start of the log, so directory entry updates stay in log order
+    if(info->dir != NULL) {
+        int index = find_dentry_update(info, old_offset);
+        if(index != -1) {
+            info->extents[index].entry_offset = new_offset;
+        }
+        return;
+    }
+    for(int i = 0; i < info->num_extents; i++) {
+        if(info->extents[i].entry_offset == old_offset) {
+            info->extents[i].entry_offset = new_offset;
+        }
+    }
+}
+
+// Helper function to append the current contents of a file or directory as a single whole log entry, superseding its
+// extents or entry updates
+int consolidate_file(unsigned int inode_number) {
+    struct wfs_log_entry *log_entry = find_latest_log_entry(inode_number);
+    struct dir_index *dir = inode_index[inode_number].dir;
+    size_t size = dir != NULL ? dir->num_dentries * sizeof(struct wfs_dentry) : log_entry->inode.size;
+
+    // With dedup the file is folded into a list of chunks, most of which are usually stored already
+    if(options.dedup && dir == NULL && size >= CHUNK_MIN_SIZE) {
+        char *data = malloc(size);
+        if(data == NULL) {
+            perror("Error allocating file data");
+            exit(EXIT_FAILURE);
+        }
+        read_file_data(inode_number, data, size, 0);
+        int res = -1;
+        if(log_has_space(chunked_data_size(data, size))) {
+            struct wfs_inode inode = log_entry->inode;
+            inode.flags &= ~(WFS_INODE_EXTENT | WFS_INODE_CHUNKED | WFS_INODE_COMPRESSED);
+            append_chunked_data(&inode, data, size, 0);
+            res = 0;
+        }
+        free(data);
+        return res;
+    }
+
+    if(!log_has_space(sizeof(struct wfs_log_entry) + size)) {
+        return -1;
+    }
+
+    struct wfs_log_entry *new_entry = dir != NULL ? head_log_entry(0, 0) : head_log_entry(sizeof(struct wfs_log_entry), size);
+    memcpy(&new_entry->inode, &log_entry->inode, sizeof(struct wfs_inode));
+    new_entry->inode.flags &= ~(WFS_INODE_EXTENT | WFS_INODE_DENTRY | WFS_INODE_CHUNKED | WFS_INODE_COMPRESSED);
+    new_entry->inode.size = size;
+    if(dir != NULL) {
+        memcpy(new_entry->data, dir->dentries, size);
+    }
+    else if(options.compress && size >= COMPRESS_MIN_SIZE) {
+        char *data = malloc(size);
+        if(data == NULL) {
+            perror("Error allocating file data");
+            exit(EXIT_FAILURE);
+        }
+        read_file_data(inode_number, data, size, 0);
+        store_entry_data(new_entry, new_entry->data, data, size);
+        free(data);
+    }
+    else {
+        read_file_data(inode_number, new_entry->data, size, 0);
+    }
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+    return 0;
+}
+
+// Helper function to find the current time in microseconds
+long monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Helper function to compare log offsets for qsort
+int compare_offsets(const void *a, const void *b) {
+    off_t x = *(const off_t *)a;
+    off_t y = *(const off_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper function to find the offsets of all live log entries from the inode index, sorted and without duplicates.
+// Returns the number of offsets
+int collect_live_offsets(off_t **offsets) {
+    int count = 0;
+    for(int i = 0; i < inode_index_capacity; i++) {
+        if(inode_index[i].latest != -1) {
+            count += 1 + inode_index[i].num_extents;
+        }
+    }
+    *offsets = malloc((count + 1) * sizeof(off_t));
+    if(*offsets == NULL) {
+        perror("Error allocating live offsets");
+        exit(EXIT_FAILURE);
+    }
+
+    count = 0;
+    for(int i = 0; i < inode_index_capacity; i++) {
+        struct inode_info *info = &inode_index[i];
+        if(info->latest == -1) {
+            continue;
+        }
+        if(info->base != -1) {
+            (*offsets)[count++] = info->base;
+        }
+        for(int j = 0; j < info->num_extents; j++) {
+            (*offsets)[count++] = info->extents[j].entry_offset;
+        }
+    }
+    qsort(*offsets, count, sizeof(off_t), compare_offsets);
+
+    // Extents split by later writes leave several ranges pointing at the same entry
+    int unique = 0;
+    for(int i = 0; i < count; i++) {
+        if(unique == 0 || (*offsets)[unique - 1] != (*offsets)[i]) {
+            (*offsets)[unique++] = (*offsets)[i];
+        }
+    }
+    return unique;
+}
+
+// Helper function to pick where a cleaning pass starts. The log is split into fixed-size segments, summarized by the
+// live bytes and the age of the newest live entry in each, and the pass starts at the segment after which cleaning
+// frees the most dead space per byte read and written, weighted by age so that dead space among cold data is reclaimed
+// first as in LFS. Segments before it, mostly live and cold, are neither read nor moved
+off_t choose_clean_start() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    off_t segment_size = SEGMENT_SIZE;
+    while(sb->head / segment_size >= MAX_SEGMENTS) {
+        segment_size *= 2;
+    }
+    int num_segments = (sb->head + segment_size - 1) / segment_size;
+
+    struct segment_usage *segments = calloc(num_segments, sizeof(struct segment_usage));
+    if(segments == NULL) {
+        perror("Error allocating segment usage");
+        exit(EXIT_FAILURE);
+    }
+    off_t *offsets;
+    int num_offsets = collect_live_offsets(&offsets);
+
+    // Spread every live entry over the segments it covers
+    off_t boundary = wfs_log_start(sb);
+    int next_segment = 0;
+    for(int i = 0; i < num_offsets; i++) {
+        struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + offsets[i]);
+        off_t start = offsets[i];
+        off_t end = start + wfs_log_entry_size(log_entry, sb);
+        for(; next_segment < num_segments && next_segment * segment_size <= start; next_segment++) {
+            segments[next_segment].clean_start = boundary;
+        }
+        for(off_t offset = start; offset < end; offset = (offset / segment_size + 1) * segment_size) {
+            struct segment_usage *segment = &segments[offset / segment_size];
+            off_t segment_end = (offset / segment_size + 1) * segment_size;
+            segment->live_bytes += (end < segment_end ? end : segment_end) - offset;
+            if(log_entry->inode.mtime > segment->newest_mtime) {
+                segment->newest_mtime = log_entry->inode.mtime;
+            }
+        }
+        boundary = end;
+    }
+    for(; next_segment < num_segments; next_segment++) {
+        segments[next_segment].clean_start = boundary;
+    }
+    free(offsets);
+
+    // Segments without live entries are given the age of the oldest data so that they are reclaimed early
+    unsigned int now = time(NULL);
+    unsigned int oldest_age = 0;
+    off_t total_dead = 0;
+    for(int i = 0; i < num_segments; i++) {
+        off_t span = (i + 1 < num_segments ? (i + 1) * segment_size : sb->head) - (i == 0 ? wfs_log_start(sb) : i * segment_size);
+        total_dead += span - segments[i].live_bytes;
+        if(segments[i].newest_mtime != 0 && segments[i].newest_mtime < now && now - segments[i].newest_mtime > oldest_age) {
+            oldest_age = now - segments[i].newest_mtime;
+        }
+    }
+
+    // Score the pass starting at every segment by the age-weighted dead bytes over the bytes read and written, and
+    // only consider passes that reclaim at least half of the dead space
+    off_t best_start = wfs_log_start(sb);
+    double best_score = -1;
+    double benefit = 0;
+    double cost = 0;
+    off_t dead = 0;
+    for(int i = num_segments - 1; i >= 0 && total_dead > 0; i--) {
+        off_t span = (i + 1 < num_segments ? (i + 1) * segment_size : sb->head) - (i == 0 ? wfs_log_start(sb) : i * segment_size);
+        unsigned int age = oldest_age;
+        if(segments[i].newest_mtime != 0) {
+            age = segments[i].newest_mtime < now ? now - segments[i].newest_mtime : 0;
+        }
+        benefit += (double)(span - segments[i].live_bytes) * (age + 1);
+        cost += span + segments[i].live_bytes;
+        dead += span - segments[i].live_bytes;
+        if(dead * 2 >= total_dead && benefit / cost > best_score) {
+            best_score = benefit / cost;
+            best_start = segments[i].clean_start;
+        }
+    }
+    free(segments);
+    return best_start;
+}
+
+// Helper function for the cleaner to leave the log entry at read_offset where it is, padding the dead gap in front of it.
+// Returns where compacted entries continue
+off_t keep_log_entry(off_t write_offset, off_t read_offset, size_t entry_size) {
+    if(write_offset < read_offset) {
+        write_padding(write_offset, read_offset);
+        mark_log_dirty(write_offset);
+    }
+    return read_offset + entry_size;
+}
+
+// Helper function to slide live log entries towards the start of the log, taking fs_lock one batch at a time. Passes
+// requested by operations that ran out of space clean the whole log, others start where choose_clean_start picks
+void clean_pass(int requested) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+
+    lock_for_append();
+
+    // Entries are about to move, so the checkpoint no longer describes the log. Its removal reaches the disk with the
+    // first write back, before anything moves
+    sb->checkpoint = 0;
+
+    // Chunks only referenced by dead entries are dead themselves
+    collect_chunks();
+    off_t start = requested ? wfs_log_start(sb) : choose_clean_start();
+
+    // Entries before write_offset are compacted, entries from read_offset on are untouched and the gap in between is
+    // made of padding, dead entries and the old copies of moved entries from pending_offset on. Old copies stay intact
+    // until the moved ones were written back, so the log is a valid chain of entries at all times and a crash at most
+    // leaves both copies of a run of entries, which replay the same way twice
+    off_t read_offset = start;
+    off_t write_offset = start;
+    while(__atomic_load_n(&cleaner_running, __ATOMIC_RELAXED) && read_offset < sb->head) {
+        // Whatever foreground operations appended since the last batch has to be on the disk before the entries it
+        // made dead are overwritten
+        write_back_log();
+        off_t *pins;
+        int num_pins = collect_read_pins(&pins);
+        off_t pending_offset = -1;
+        off_t batch_end = read_offset + CLEANER_BATCH_BYTES;
+        while(read_offset < sb->head && read_offset < batch_end) {
+            struct wfs_log_entry *log_entry = (struct wfs_log_entry *)((char *)mapped_data + read_offset);
+            size_t entry_size = wfs_log_entry_size(log_entry, sb);
+
+            // A reply of read_buf may still refer to the entry, dead or not, so it stays where it is
+            if(log_range_pinned(pins, num_pins, read_offset, read_offset + entry_size)) {
+                if(pending_offset != -1) {
+                    write_back_log();
+                    pending_offset = -1;
+                }
+                write_offset = keep_log_entry(write_offset, read_offset, entry_size);
+                read_offset += entry_size;
+                stat_add(&stats.cleaner_pinned_entries, 1);
+                continue;
+            }
+
+            int live = is_live_log_entry(log_entry, read_offset);
+            // Entries before start were not looked at, so tombstones still have to remove the ones left there
+            int tombstone = !live && start > wfs_log_start(sb) && !log_entry->inode.deleted &&
+                            (log_entry->inode.flags & WFS_INODE_TOMBSTONE) && log_entry->inode.inode_number < inode_index_capacity;
+            if(live || tombstone) {
+                unsigned int inode_number = log_entry->inode.inode_number;
+
+                // Fold a fragmented file, or a directory with more updates than entries, into one entry at the head,
+                // which leaves this entry dead
+                struct inode_info *info = &inode_index[inode_number];
+                if(live && info->num_extents > CLEANER_CONSOLIDATE_EXTENTS && (info->dir == NULL || info->num_extents > info->dir->num_dentries) &&
+                   consolidate_file(inode_number) == 0) {
+                    stat_add(&stats.cleaner_consolidations, 1);
+                    read_offset += entry_size;
+                    continue;
+                }
+
+                // Once the moved copies reach the old ones, write them back so that the old ones can be padded
+                off_t limit = pending_offset != -1 ? pending_offset : read_offset;
+                off_t target = place_log_entry(log_entry, entry_size, write_offset, limit);
+                if(target == -1 && pending_offset != -1) {
+                    write_back_log();
+                    write_padding(write_offset, read_offset);
+                    mark_log_dirty(write_offset);
+                    pending_offset = -1;
+                    limit = read_offset;
+                    target = place_log_entry(log_entry, entry_size, write_offset, limit);
+                }
+
+                // An entry that would overlap its own old copy stays where it is
+                if(target == -1) {
+                    write_offset = keep_log_entry(write_offset, read_offset, entry_size);
+                    read_offset += entry_size;
+                    continue;
+                }
+
+                memmove((char *)mapped_data + target, log_entry, entry_size);
+                if(target + entry_size < limit) {
+                    write_padding(target + entry_size, limit);
+                }
+                mark_log_dirty(write_offset);
+                relocate_log_entry(inode_number, read_offset, target);
+                stat_add(&stats.cleaner_bytes_moved, entry_size);
+                if(pending_offset == -1) {
+                    pending_offset = read_offset;
+                }
+                write_offset = target + entry_size;
+            }
+            read_offset += entry_size;
+        }
+
+        if(pending_offset != -1) {
+            write_back_log();
+        }
+        if(write_offset < read_offset) {
+            write_padding(write_offset, read_offset);
+            mark_log_dirty(write_offset);
+        }
+        free(pins);
+        clear_decompress_cache();
+
+        // Let foreground operations in between batches
+        if(read_offset < sb->head) {
+            unlock_for_append();
+            usleep(CLEANER_BATCH_DELAY_US);
+            lock_for_append();
+        }
+    }
+
+    // Reclaim everything after the compacted entries once the whole log was cleaned. The zeros reach the disk before the
+    // head moves back, so that an append torn by a crash later can't make fsck.wfs find the stale entries behind it
+    if(read_offset >= sb->head && write_offset < sb->head) {
+        memset((char *)mapped_data + write_offset, 0, sb->head - write_offset);
+        mark_log_dirty(write_offset);
+        write_back_log();
+        stat_add(&stats.cleaner_bytes_reclaimed, sb->head - write_offset);
+        sb->head = write_offset;
+        dirty_offset = write_offset;
+    }
+    pthread_mutex_lock(&cleaner_lock);
+    // Don't take space away from operations waiting for this pass, the next one or unmount will checkpoint
+    if(!cleaner_requested) {
+        write_checkpoint();
+    }
+    cleaner_last_head = sb->head;
+    cleaner_requested = 0;
+    cleaner_passes++;
+    pthread_cond_broadcast(&cleaner_done_cond);
+    pthread_mutex_unlock(&cleaner_lock);
+
+    unlock_for_append();
+}
+
+// Function executed by the cleaner thread, which reclaims dead space and checkpoints the inode index in the background
+void *clean_log(void *arg) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+
+    pthread_mutex_lock(&cleaner_lock);
+    while(cleaner_running) {
+        int requested = cleaner_requested;
+        off_t last_head = cleaner_last_head;
+        pthread_mutex_unlock(&cleaner_lock);
+
+        lock_for_append();
+        // Checkpoint the inode index every so often so that the next mount only replays the tail of the log. When space
+        // is low, cleaning passes take care of it instead
+        if(disk_size - sb->head >= disk_size / CLEANER_FREE_FRACTION && checkpoint_due()) {
+            write_checkpoint();
+        }
+        // Clean once free space runs low or an operation ran out of it, and something was appended since the last pass
+        int clean = (disk_size - sb->head < disk_size / CLEANER_FREE_FRACTION || requested) && sb->head != last_head;
+        unlock_for_append();
+
+        if(clean) {
+            clean_pass(requested);
+            pthread_mutex_lock(&cleaner_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&cleaner_lock);
+        if(requested) {
+            // Nothing to reclaim, let waiting operations fail instead of waiting forever
+            cleaner_requested = 0;
+            pthread_cond_broadcast(&cleaner_done_cond);
+        }
+        else if(!cleaner_requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += CLEANER_POLL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&cleaner_cond, &cleaner_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&cleaner_lock);
+
+    return NULL;
+}
+
+// Helper function to append a log entry adding or removing a single entry of a directory
+void append_dentry_update(struct wfs_log_entry *dir_log_entry, unsigned int op, const char *name, unsigned int inode_number) {
+    struct wfs_log_entry *new_entry = head_log_entry(0, 0);
+    memcpy(&new_entry->inode, &dir_log_entry->inode, sizeof(struct wfs_inode));
+    new_entry->inode.flags = WFS_INODE_DENTRY;
+    if(op == WFS_DENTRY_ADD) {
+        new_entry->inode.size += sizeof(struct wfs_dentry);
+    }
+    else {
+        new_entry->inode.size -= sizeof(struct wfs_dentry);
+    }
+    new_entry->inode.mtime = time(NULL);
+    new_entry->inode.ctime = time(NULL);
+
+    struct wfs_dentry_update *update = (struct wfs_dentry_update *)new_entry->data;
+    memset(update, 0, sizeof(struct wfs_dentry_update));
+    update->op = op;
+    strncpy(update->dentry.name, name, MAX_FILE_NAME_LEN - 1);
+    update->dentry.inode_number = inode_number;
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+
+    // Fold the directory once its updates outnumber its entries, so that a churning directory never has more live
+    // updates than it has entries, even if the log fills up before the cleaner gets to it. The operation reserved space
+    // without the fold, so it is only done if the log still has room for the at most two entry updates that follow
+    struct inode_info *info = &inode_index[new_entry->inode.inode_number];
+    size_t rest = 2 * log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry_update));
+    if(info->num_extents > CLEANER_CONSOLIDATE_EXTENTS && info->num_extents > info->dir->num_dentries &&
+       log_has_space(sizeof(struct wfs_log_entry) + info->dir->num_dentries * sizeof(struct wfs_dentry) + rest)) {
+        consolidate_file(new_entry->inode.inode_number);
+    }
+}
+
+// Helper function to append a log entry changing only the inode of a file or directory, such as its size or times,
+// without copying any of its data
+void append_inode_update(const struct wfs_inode *inode) {
+    struct wfs_log_entry *new_entry = head_log_entry(0, 0);
+    memcpy(&new_entry->inode, inode, sizeof(struct wfs_inode));
+    new_entry->inode.deleted = 0;
+
+    // Directories take an entry update that leaves their entries alone, files an empty extent
+    if(S_ISDIR(inode->mode)) {
+        new_entry->inode.flags = WFS_INODE_DENTRY;
+        struct wfs_dentry_update *update = (struct wfs_dentry_update *)new_entry->data;
+        memset(update, 0, sizeof(struct wfs_dentry_update));
+        update->op = WFS_DENTRY_NONE;
+    }
+    else {
+        new_entry->inode.flags = WFS_INODE_EXTENT;
+        struct wfs_extent *extent = (struct wfs_extent *)new_entry->data;
+        extent->offset = inode->size;
+        extent->length = 0;
+    }
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+}
+
+// Helper function to count a call of an operation that started at start_us
+void record_op(enum wfs_op op, long start_us) {
+    long elapsed_us = monotonic_us() - start_us;
+    int bucket = 0;
+    while(bucket < STATS_LATENCY_BUCKETS - 1 && elapsed_us >= (1L << bucket)) {
+        bucket++;
+    }
+    stat_add(&op_stats[op].calls, 1);
+    stat_add(&op_stats[op].total_us, elapsed_us);
+    stat_add(&op_stats[op].latency_buckets[bucket], 1);
+}
+
+// Helper function to check if a path names the statistics file
+int is_stats_path(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+// Helper function to load a counter of the statistics
+unsigned long stat_load(unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Helper function to write the contents of the statistics file, one "name value" line per counter. Latency histograms
+// list the upper bound in microseconds and the count of every bucket that isn't empty. Returns the length of the text,
+// which the caller frees. Called with fs_lock held at least shared
+size_t build_stats_text(char **text) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    size_t length;
+    FILE *stream = open_memstream(text, &length);
+    if(stream == NULL) {
+        perror("Error allocating statistics");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int op = 0; op < NUM_OPS; op++) {
+        unsigned long calls = stat_load(&op_stats[op].calls);
+        unsigned long total_us = stat_load(&op_stats[op].total_us);
+        fprintf(stream, "%s_calls %lu\n", op_names[op], calls);
+        fprintf(stream, "%s_avg_us %.1f\n", op_names[op], calls > 0 ? (double)total_us / calls : 0.0);
+        fprintf(stream, "%s_latency_us", op_names[op]);
+        for(int bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+            unsigned long count = stat_load(&op_stats[op].latency_buckets[bucket]);
+            if(count == 0) {
+                continue;
+            }
+            if(bucket == STATS_LATENCY_BUCKETS - 1) {
+                fprintf(stream, " inf:%lu", count);
+            }
+            else {
+                fprintf(stream, " %ld:%lu", 1L << bucket, count);
+            }
+        }
+        fprintf(stream, "\n");
+    }
+
+    // Live bytes are those of the entries the inode index points at, everything else up to the head is dead
+    off_t *offsets;
+    int num_offsets = collect_live_offsets(&offsets);
+    off_t live_bytes = 0;
+    for(int i = 0; i < num_offsets; i++) {
+        live_bytes += wfs_log_entry_size((struct wfs_log_entry *)((char *)mapped_data + offsets[i]), sb);
+    }
+    free(offsets);
+    unsigned long reclaimed = stat_load(&stats.cleaner_bytes_reclaimed);
+    fprintf(stream, "log_bytes_appended %lu\n", (unsigned long)(sb->head - mount_head + reclaimed));
+    fprintf(stream, "log_head %lu\n", (unsigned long)sb->head);
+    fprintf(stream, "log_live_bytes %lu\n", (unsigned long)live_bytes);
+    fprintf(stream, "log_dead_bytes %lu\n", (unsigned long)(sb->head - wfs_log_start(sb) - live_bytes));
+    fprintf(stream, "disk_size %lu\n", (unsigned long)disk_size);
+
+    fprintf(stream, "dentry_lookup_hits %lu\n", stat_load(&stats.dentry_hits));
+    fprintf(stream, "dentry_lookup_misses %lu\n", stat_load(&stats.dentry_misses));
+    fprintf(stream, "chunk_index_hits %lu\n", stat_load(&stats.chunk_hits));
+    fprintf(stream, "chunk_index_misses %lu\n", stat_load(&stats.chunk_misses));
+    fprintf(stream, "decompress_cache_hits %lu\n", stat_load(&stats.decompress_hits));
+    fprintf(stream, "decompress_cache_misses %lu\n", stat_load(&stats.decompress_misses));
+
+    pthread_mutex_lock(&cleaner_lock);
+    unsigned long passes = cleaner_passes;
+    pthread_mutex_unlock(&cleaner_lock);
+    fprintf(stream, "cleaner_passes %lu\n", passes);
+    fprintf(stream, "cleaner_bytes_moved %lu\n", stat_load(&stats.cleaner_bytes_moved));
+    fprintf(stream, "cleaner_bytes_reclaimed %lu\n", reclaimed);
+    fprintf(stream, "cleaner_consolidations %lu\n", stat_load(&stats.cleaner_consolidations));
+    fprintf(stream, "cleaner_pinned_entries %lu\n", stat_load(&stats.cleaner_pinned_entries));
+    fprintf(stream, "checkpoints_written %lu\n", stat_load(&stats.checkpoints));
+
+    fclose(stream);
+    return length;
+}
+
+// Helper function to append an extent written to a file to the log, returns the number of bytes written or -ENOSPC.
+// Called with append_lock held and fs_lock held exclusively, which large extents release while their data is copied.
+// Callers such as wfs_write and flush_overlapping_buffers keep pointers to log entries and write buffers across the
+// call, which only stay valid because append_lock keeps every other writer and the cleaner out until they return
+int append_extent(unsigned int inode_number, const char* buffer, size_t size, off_t offset) {
+    struct wfs_log_entry *log_entry = find_latest_log_entry(inode_number);
+
+    // Compute the new size of the file after the write operation
+    off_t new_size;
+    if(offset + size > log_entry->inode.size) {
+        new_size = offset + size;
+    }
+    else {
+        new_size = log_entry->inode.size;
+    }
+
+    struct wfs_inode inode;
+    memset(&inode, 0, sizeof(struct wfs_inode));
+    inode.inode_number = log_entry->inode.inode_number;
+    inode.deleted = 0;
+    inode.mode = __S_IFREG;
+    inode.uid = getuid();
+    inode.gid = getgid();
+    inode.flags = WFS_INODE_EXTENT;
+    inode.size = new_size;
+    inode.atime = time(NULL);
+    inode.mtime = time(NULL);
+    inode.ctime = time(NULL);
+    inode.links = 1;
+
+    // With dedup, store the extent as references to chunks and only append the chunks that aren't stored yet
+    if(options.dedup && size >= CHUNK_MIN_SIZE) {
+        if(reserve_log_space(chunked_data_size(buffer, size)) == -1) {
+            return -ENOSPC;
+        }
+        append_chunked_data(&inode, buffer, size, offset);
+        return size;
+    }
+
+    // Check if space exists in the log file system for this operation
+    if(reserve_log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent) + size) == -1) {
+        return -ENOSPC;
+    }
+
+    // Construct new entry holding only the extent that is being written to the file
+    struct wfs_log_entry *new_entry = head_log_entry(sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent), size);
+    memcpy(&new_entry->inode, &inode, sizeof(struct wfs_inode));
+
+    // Write buffer contents to the extent. Reads never look past the head, which only moves once fs_lock is taken again,
+    // so large extents are copied and checksummed with fs_lock released and reads carry on meanwhile
+    struct wfs_extent *extent = (struct wfs_extent *)new_entry->data;
+    extent->offset = offset;
+    extent->length = size;
+    if(size >= UNLOCKED_APPEND_MIN_SIZE) {
+        pthread_rwlock_unlock(&fs_lock);
+        store_entry_data(new_entry, extent->data, buffer, size);
+        new_entry->inode.checksum = wfs_checksum(new_entry);
+        pthread_rwlock_wrlock(&fs_lock);
+        index_log_entry(new_entry);
+        publish_head(new_entry);
+        return size;
+    }
+    store_entry_data(new_entry, extent->data, buffer, size);
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+
+    return size;
+}
+
+// Helper function to append the writes held by the buffer of an open file to the log as one extent
+int flush_write_buffer(struct write_buffer *write_buffer) {
+    if(write_buffer->length == 0) {
+        return 0;
+    }
+    int res = append_extent(write_buffer->inode_number, write_buffer->data, write_buffer->length, write_buffer->offset);
+    if(res < 0) {
+        return res;
+    }
+    write_buffer->length = 0;
+    return 0;
+}
+
+// Helper function to flush the buffers of open files of an inode that overlap a write, other than the one it goes into,
+// so that a buffer flushed later can't undo it
+int flush_overlapping_buffers(unsigned int inode_number, off_t offset, size_t size, struct write_buffer *except) {
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(write_buffer != except && write_buffer->inode_number == inode_number && write_buffer->length > 0 &&
+           write_buffer->offset < offset + size && offset < write_buffer->offset + write_buffer->length) {
+            int res = flush_write_buffer(write_buffer);
+            if(res < 0) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function to drop the buffered writes of a file that was removed, returns the number of its open files
+int discard_write_buffers(unsigned int inode_number) {
+    int num_open = 0;
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(write_buffer->inode_number == inode_number) {
+            write_buffer->length = 0;
+            write_buffer->removed = 1;
+            num_open++;
+        }
+    }
+    return num_open;
+}
+
+// Helper function to check if open files of an inode have buffered writes
+int has_write_buffers(unsigned int inode_number) {
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(write_buffer->inode_number == inode_number && write_buffer->length > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to find the size of a file including the writes buffered by its open files
+off_t buffered_file_size(struct wfs_inode *inode) {
+    off_t size = inode->size;
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(write_buffer->inode_number == inode->inode_number && write_buffer->length > 0 &&
+           write_buffer->offset + write_buffer->length > size) {
+            size = write_buffer->offset + write_buffer->length;
+        }
+    }
+    return size;
+}
+
+// Helper function to read bytes of a file, including the writes buffered by its open files
+void read_buffered_file_data(unsigned int inode_number, char *buffer, size_t size, off_t offset) {
+    read_file_data(inode_number, buffer, size, offset);
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(write_buffer->inode_number != inode_number || write_buffer->length == 0) {
+            continue;
+        }
+        off_t start = write_buffer->offset > offset ? write_buffer->offset : offset;
+        off_t end = write_buffer->offset + write_buffer->length < offset + size ? write_buffer->offset + write_buffer->length : offset + size;
+        if(start < end) {
+            memcpy(buffer + (start - offset), write_buffer->data + (start - write_buffer->offset), end - start);
+        }
+    }
+}
+
+// Helper function to add a write to the buffer of an open file, flushing what it holds first if the write doesn't
+// continue or overlap it or wouldn't fit
+int buffer_write(struct write_buffer *write_buffer, const char* buffer, size_t size, off_t offset) {
+    if(write_buffer->length > 0 &&
+       (offset < write_buffer->offset || offset > write_buffer->offset + write_buffer->length ||
+        offset + size - write_buffer->offset > WRITE_BUFFER_SIZE)) {
+        int res = flush_write_buffer(write_buffer);
+        if(res < 0) {
+            return res;
+        }
+    }
+    if(write_buffer->length == 0) {
+        write_buffer->offset = offset;
+    }
+
+    size_t end = offset + size - write_buffer->offset;
+    if(end > write_buffer->capacity) {
+        size_t new_capacity = write_buffer->capacity > 0 ? write_buffer->capacity : 4096;
+        while(new_capacity < end) {
+            new_capacity *= 2;
+        }
+        write_buffer->data = realloc(write_buffer->data, new_capacity);
+        if(write_buffer->data == NULL) {
+            perror("Error growing write buffer");
+            exit(EXIT_FAILURE);
+        }
+        write_buffer->capacity = new_capacity;
+    }
+    memcpy(write_buffer->data + (offset - write_buffer->offset), buffer, size);
+    if(end > write_buffer->length) {
+        write_buffer->length = end;
+    }
+    return size;
+}
+
+// Helper function to remove a file or directory from its parent directory and append a tombstone for its inode
+void remove_file(unsigned int parent_inode_number, const char *name, unsigned int inode_number) {
+    // Append a tombstone for the inode. Entries of a new inode reusing the number come after it, so neither the index
+    // nor a replay of the log can confuse them with the entries of this one
+    append_tombstone(inode_number);
+
+    // Files of the inode open for writing keep its number from being reused until wfs_release drops the last of them,
+    // or a buffer still tagged with it could be flushed into the file reusing it
+    if(discard_write_buffers(inode_number) == 0) {
+        release_inode_number(inode_number);
+    }
+
+    append_dentry_update(find_latest_log_entry(parent_inode_number), WFS_DENTRY_REMOVE, name, inode_number);
+}
+
+// Helper function to fill a stat structure from the inode of a log entry
+void fill_stat(struct wfs_inode *inode, struct stat *stbuf) {
+    stbuf->st_ino = inode->inode_number;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->links;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_size = inode->size;
+    stbuf->st_atime = inode->atime;
+    stbuf->st_mtime = inode->mtime;
+    stbuf->st_ctime = inode->ctime;
+}
+
+static int wfs_getattr(const char *path, struct stat *stbuf) {
+    // The statistics file has no size of its own, its contents are built whenever it is read
+    if(is_stats_path(path)) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_size = 0;
+        stbuf->st_mtime = time(NULL);
+        return 0;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+    
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
+
+    // Update the stat structure
+    fill_stat(&log_entry->inode, stbuf);
+    stbuf->st_size = buffered_file_size(&log_entry->inode);
+    return 0;
+}
+
+static int wfs_mknod(const char *path, mode_t mode, dev_t device) {
+    if(is_stats_path(path)) {
+        return -EEXIST;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+
+    // Check if log entry already exists
+    if(log_entry != NULL) {
+        return -EEXIST;
+    }
+
+    // Separate filename and path to the directory that the file is located in
+    char path_copy[MAX_PATH_NAME_LEN];
+    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
+    struct wfs_path_info path_info;
+    separate_path_and_file(path_copy, &path_info);
+
+    // Find latest log entry for the parent directory
+    struct wfs_log_entry *parent_log_entry = find_log_entry_by_path(path_info.parent_path);
+    
+    // Check if parent log entry exists
+    if(parent_log_entry == NULL) {
+        return -ENOENT;
+    }
+    
+    // Check if space exists in the log file system for both log entries appended by this operation
+    if(reserve_log_space(2 * sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry_update)) == -1) {
+        return -ENOSPC;
+    }
+
+    // Find an inode number not in use to assign to the new file
+    unsigned int new_inode_number = allocate_inode_number();
+     
+    // Add the new file to the parent directory
+    append_dentry_update(parent_log_entry, WFS_DENTRY_ADD, path_info.filename, new_inode_number);
+
+    // Construct log entry for the new file
+    struct wfs_log_entry *new_entry = head_log_entry(0, 0);
+    new_entry->inode.inode_number = new_inode_number;
+    new_entry->inode.deleted = 0;
+    new_entry->inode.mode = __S_IFREG;
+    new_entry->inode.uid = getuid();
+    new_entry->inode.gid = getgid();
+    new_entry->inode.flags = 0;
+    new_entry->inode.size = 0;
+    new_entry->inode.atime = time(NULL);
+    new_entry->inode.mtime = time(NULL);
+    new_entry->inode.ctime = time(NULL);
+    new_entry->inode.links = 1;
+    new_entry->inode.reserved = 0;
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+
+    return 0;
+}
+
+static int wfs_mkdir(const char *path, mode_t mode) {
+    if(is_stats_path(path)) {
+        return -EEXIST;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+
+    // Check if log entry already exists
+    if(log_entry != NULL) {
+        return -EEXIST;
+    }
+
+    // Separate directory name and path to the directory that the new directory is located in
+    char path_copy[MAX_PATH_NAME_LEN];
+    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
+    struct wfs_path_info path_info;
+    separate_path_and_file(path_copy, &path_info);
+
+    // Find latest log entry for the parent directory
+    struct wfs_log_entry *parent_log_entry = find_log_entry_by_path(path_info.parent_path);
+
+    // Check if parent log entry exists
+    if(parent_log_entry == NULL) {
+        return -ENOENT;
+    }
+
+    // Check if space exists in the log file system for both log entries appended by this operation
+    if(reserve_log_space(2 * sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry_update)) == -1) {
+        return -ENOSPC;
+    }
+
+    // Find an inode number not in use to assign to the new directory
+    unsigned int new_inode_number = allocate_inode_number();
+
+    // Add the new directory to the parent directory
+    append_dentry_update(parent_log_entry, WFS_DENTRY_ADD, path_info.filename, new_inode_number);
+
+    // Construct log entry for the new directory
+    struct wfs_log_entry *new_entry = head_log_entry(0, 0);
+    new_entry->inode.inode_number = new_inode_number;
+    new_entry->inode.deleted = 0;
+    new_entry->inode.mode = __S_IFDIR;
+    new_entry->inode.uid = getuid();
+    new_entry->inode.gid = getgid();
+    new_entry->inode.flags = 0;
+    new_entry->inode.size = 0;
+    new_entry->inode.atime = time(NULL);
+    new_entry->inode.mtime = time(NULL);
+    new_entry->inode.ctime = time(NULL);
     new_entry->inode.links = 1;
+    new_entry->inode.reserved = 0;
+
+    index_log_entry(new_entry);
+    advance_head(new_entry);
+
+    return 0;
+}
+
+static int wfs_read(const char *path, char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
+    if(is_stats_path(path)) {
+        char *text;
+        size_t length = build_stats_text(&text);
+        size_t bytes_to_read = offset < length ? (length - offset < size ? length - offset : size) : 0;
+        memcpy(buffer, text + offset, bytes_to_read);
+        free(text);
+        return bytes_to_read;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
+    
+    // Check if offset is valid and within filesize, counting writes buffered by open files
+    off_t file_size = buffered_file_size(&log_entry->inode);
+    if (offset >= file_size) {
+        return 0;
+    }
+
+    // Compute the number of bytes that need to be read from the offset
+    size_t bytes_to_read;
+    if(size > file_size - offset) {
+        bytes_to_read = file_size - offset;
+    }
+    else {
+        bytes_to_read = size;
+    }
+
+    // Read file contents to the buffer
+    read_buffered_file_data(log_entry->inode.inode_number, buffer, bytes_to_read, offset);
+    return bytes_to_read;
+}
+
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info* info) {
+    if(is_stats_path(path)) {
+        char *mem;
+        *bufp = append_mem_buf(new_bufvec(), size, &mem);
+        (*bufp)->buf[0].size = wfs_read(path, mem, size, offset, info);
+        return 0;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
+
+    // Compute the number of bytes that need to be read from the offset, none past the end of the file
+    off_t file_size = buffered_file_size(&log_entry->inode);
+    size_t bytes_to_read = 0;
+    if(offset < file_size) {
+        bytes_to_read = size > file_size - offset ? file_size - offset : size;
+    }
+
+    // Bytes still buffered by open files of the file are copied along with the rest
+    if(has_write_buffers(log_entry->inode.inode_number)) {
+        char *mem;
+        *bufp = append_mem_buf(new_bufvec(), bytes_to_read, &mem);
+        read_buffered_file_data(log_entry->inode.inode_number, mem, bytes_to_read, offset);
+        return 0;
+    }
+
+    // Point libfuse at the file contents within the disk image so that it can splice them without copying
+    *bufp = build_file_bufvec(log_entry->inode.inode_number, bytes_to_read, offset);
+    return 0;
+}
+
+static int wfs_write(const char *path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
+    if(is_stats_path(path)) {
+        return -EACCES;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+    
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
+    unsigned int inode_number = log_entry->inode.inode_number;
+
+    // Writes through an open file of this inode are buffered unless they are large enough to append on their own
+    struct write_buffer *write_buffer = info != NULL ? (struct write_buffer *)(uintptr_t)info->fh : NULL;
+    if(write_buffer != NULL && (write_buffer->inode_number != inode_number || size >= WRITE_BUFFER_SIZE)) {
+        write_buffer = NULL;
+    }
+
+    int res = flush_overlapping_buffers(inode_number, offset, size, write_buffer);
+    if(res < 0) {
+        return res;
+    }
+    if(write_buffer != NULL) {
+        return buffer_write(write_buffer, buffer, size, offset);
+    }
+    return append_extent(inode_number, buffer, size, offset);
+}
+
+static int wfs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* info) {
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+    
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
+
+    // Check if current path corresponds to a directory
+    if(S_ISREG(log_entry->inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    // Extract the directory entries for the directory from its index
+    struct dir_index *dir = inode_index[log_entry->inode.inode_number].dir;
+
+    // Add entries for . and ..
+    filler(buffer, ".", NULL, 0);
+    filler(buffer, "..", NULL, 0);
+
+    // Iterate over the directory entries and call the filler function for each entry. The high-level API of libfuse 2
+    // has no readdirplus, so the kernel wouldn't keep attributes given to filler and they are left to getattr
+    for (int i = 0; dir != NULL && i < dir->num_dentries; ++i) {
+        filler(buffer, dir->dentries[i].name, NULL, 0);
+    }
+    
+    return 0;
+}
+
+static int wfs_unlink(const char *path) {
+    if(is_stats_path(path)) {
+        return -EACCES;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+    
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
+
+    // Check if current path corresponds to a directory
+    if(S_ISDIR(log_entry->inode.mode)) {
+        return -EISDIR;
+    }
+
+    // Separate directory name and path to the directory that the new directory is located in
+    char path_copy[MAX_PATH_NAME_LEN];
+    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
+    struct wfs_path_info path_info;
+    separate_path_and_file(path_copy, &path_info);
+
+    // Find latest log entry for the parent directory
+    struct wfs_log_entry *parent_log_entry = find_log_entry_by_path(path_info.parent_path);
+    
+    // Check if parent log entry exists
+    if(parent_log_entry == NULL) {
+        return -ENOENT;
+    }
 
-    sb->head += sizeof(struct wfs_log_entry) + new_entry->inode.size;
+    // Check if space exists in the log file system for this operation
+    if(reserve_log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry_update)) == -1) {
+        return -ENOSPC;
+    }
 
+    // Remove the deleted file from the parent directory
+    remove_file(parent_log_entry->inode.inode_number, path_info.filename, log_entry->inode.inode_number);
     return 0;
 }
 
-static int wfs_mkdir(const char *path, mode_t mode) {
+static int wfs_rmdir(const char *path) {
+    if(is_stats_path(path)) {
+        return -ENOTDIR;
+    }
+
     // Find latest log entry for the given path
     struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
 
-    // Check if log entry already exists
-    if(log_entry != NULL) {
-        return -EEXIST;
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
     }
 
-    // Separate directory name and path to the directory that the new directory is located in
+    // Check if current path corresponds to a directory, other than the root, without any entries
+    if(!S_ISDIR(log_entry->inode.mode)) {
+        return -ENOTDIR;
+    }
+    unsigned int inode_number = log_entry->inode.inode_number;
+    if(inode_number == ROOT_INODE_NUMBER) {
+        return -EBUSY;
+    }
+    struct dir_index *dir = inode_index[inode_number].dir;
+    if(dir != NULL && dir->num_dentries > 0) {
+        return -ENOTEMPTY;
+    }
+
+    // Separate directory name and path to the directory that it is located in
     char path_copy[MAX_PATH_NAME_LEN];
     strncpy(path_copy, path, MAX_PATH_NAME_LEN);
     struct wfs_path_info path_info;
@@ -288,246 +3137,614 @@ static int wfs_mkdir(const char *path, mode_t mode) {
         return -ENOENT;
     }
 
-    // Find the next inode number not in use to assign to the new directory
-    int new_inode_number = find_max_inode_number() + 1;
-    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-
-    // Check if space exists in the log file system for this operation
-    if(sb->head + sizeof(struct wfs_log_entry) + parent_log_entry->inode.size + sizeof(struct wfs_dentry) > disk_size) {
-        return -ENOSPC;
-    } 
-
-    // Construct new parent log entry containing the new directory
-    struct wfs_log_entry *new_parent_log_entry = (struct wfs_log_entry *)((char*)mapped_data + sb->head);
-    memcpy(new_parent_log_entry, parent_log_entry, sizeof(struct wfs_log_entry) + parent_log_entry->inode.size);
-    struct wfs_dentry *entries = (struct wfs_dentry *)new_parent_log_entry->data;
-    int num_entries = new_parent_log_entry->inode.size / sizeof(struct wfs_dentry);
-    memcpy(entries[num_entries].name, path_info.filename, MAX_FILE_NAME_LEN);
-    entries[num_entries].inode_number = new_inode_number;
-    new_parent_log_entry->inode.size += sizeof(struct wfs_dentry);
-    sb->head += sizeof(struct wfs_log_entry) + new_parent_log_entry->inode.size;
-
     // Check if space exists in the log file system for this operation
-    if(sb->head + sizeof(struct wfs_log_entry) > disk_size) {
+    if(reserve_log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry_update)) == -1) {
         return -ENOSPC;
     }
 
-    // Construct log entry for the new directory
-    struct wfs_log_entry *new_entry = (struct wfs_log_entry *)((char*)mapped_data + sb->head);
-    new_entry->inode.inode_number = new_inode_number;
-    new_entry->inode.deleted = 0;
-    new_entry->inode.mode = __S_IFDIR;
-    new_entry->inode.uid = getuid();
-    new_entry->inode.gid = getgid();
-    new_entry->inode.flags = 0;
-    new_entry->inode.size = 0;
-    new_entry->inode.atime = time(NULL);
-    new_entry->inode.mtime = time(NULL);
-    new_entry->inode.ctime = time(NULL);
-    new_entry->inode.links = 1;
-
-    sb->head += sizeof(struct wfs_log_entry) + new_entry->inode.size;
-
+    // Remove the deleted directory from the parent directory
+    remove_file(parent_log_entry->inode.inode_number, path_info.filename, inode_number);
     return 0;
 }
 
-static int wfs_read(const char *path, char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
-    // Find latest log entry for the given path
-    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
+static int wfs_rename(const char *from, const char *to) {
+    if(is_stats_path(from) || is_stats_path(to)) {
+        return -EACCES;
+    }
+
+    // Find latest log entry for the path being renamed
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(from);
 
     // Check if log entry exists
     if(log_entry == NULL) {
         return -ENOENT;
     }
-    
-    // Check if offset is valid and within filesize
-    if (offset >= log_entry->inode.size) {
-        return 0;
+    unsigned int inode_number = log_entry->inode.inode_number;
+    if(inode_number == ROOT_INODE_NUMBER) {
+        return -EBUSY;
     }
 
-    // Compute the number of bytes that need to be read from the offset
-    size_t bytes_to_read;
-    if(size > log_entry->inode.size - offset) {
-        bytes_to_read = log_entry->inode.size - offset;
+    // A directory can't be moved into itself
+    size_t from_length = strlen(from);
+    if(S_ISDIR(log_entry->inode.mode) && strncmp(to, from, from_length) == 0 && to[from_length] == '/') {
+        return -EINVAL;
     }
-    else {
-        bytes_to_read = size;
+
+    // Separate both paths into the name and the path to the directory holding it
+    char path_copy[MAX_PATH_NAME_LEN];
+    struct wfs_path_info from_info;
+    strncpy(path_copy, from, MAX_PATH_NAME_LEN);
+    separate_path_and_file(path_copy, &from_info);
+    struct wfs_path_info to_info;
+    strncpy(path_copy, to, MAX_PATH_NAME_LEN);
+    separate_path_and_file(path_copy, &to_info);
+
+    // Find latest log entries for both parent directories
+    struct wfs_log_entry *from_parent_log_entry = find_log_entry_by_path(from_info.parent_path);
+    struct wfs_log_entry *to_parent_log_entry = find_log_entry_by_path(to_info.parent_path);
+    if(from_parent_log_entry == NULL || to_parent_log_entry == NULL) {
+        return -ENOENT;
+    }
+    if(!S_ISDIR(to_parent_log_entry->inode.mode)) {
+        return -ENOTDIR;
+    }
+    unsigned int from_parent = from_parent_log_entry->inode.inode_number;
+    unsigned int to_parent = to_parent_log_entry->inode.inode_number;
+
+    // An existing file or empty directory at the new path is replaced
+    struct wfs_log_entry *target_log_entry = find_log_entry_by_path(to);
+    if(target_log_entry != NULL) {
+        unsigned int target_inode_number = target_log_entry->inode.inode_number;
+        if(target_inode_number == inode_number) {
+            return 0;
+        }
+        if(target_inode_number == ROOT_INODE_NUMBER) {
+            return -EBUSY;
+        }
+        if(S_ISDIR(target_log_entry->inode.mode) && !S_ISDIR(log_entry->inode.mode)) {
+            return -EISDIR;
+        }
+        if(!S_ISDIR(target_log_entry->inode.mode) && S_ISDIR(log_entry->inode.mode)) {
+            return -ENOTDIR;
+        }
+        struct dir_index *dir = inode_index[target_inode_number].dir;
+        if(dir != NULL && dir->num_dentries > 0) {
+            return -ENOTEMPTY;
+        }
     }
 
-    // Read file contents to the buffer
-    memcpy(buffer, log_entry->data + offset, bytes_to_read);
-    return bytes_to_read;
+    // Check if space exists in the log file system for the entry updates and the tombstone of a replaced file
+    if(reserve_log_space(4 * sizeof(struct wfs_log_entry) + 3 * sizeof(struct wfs_dentry_update)) == -1) {
+        return -ENOSPC;
+    }
+    if(target_log_entry != NULL) {
+        remove_file(to_parent, to_info.filename, target_log_entry->inode.inode_number);
+    }
+
+    // Only the two directories change, the inode and the data of the file stay where they are. The new name goes in
+    // first, so that a crash in between leaves the file under both names rather than under none
+    append_dentry_update(find_latest_log_entry(to_parent), WFS_DENTRY_ADD, to_info.filename, inode_number);
+    append_dentry_update(find_latest_log_entry(from_parent), WFS_DENTRY_REMOVE, from_info.filename, inode_number);
+    return 0;
 }
 
-static int wfs_write(const char *path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
+static int wfs_truncate(const char *path, off_t size) {
+    if(is_stats_path(path)) {
+        return -EACCES;
+    }
+
     // Find latest log entry for the given path
     struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
-    
+
     // Check if log entry exists
     if(log_entry == NULL) {
         return -ENOENT;
     }
 
-    // Compute the new size of the file after the write operation
-    int new_size;
-    if(offset + size > log_entry->inode.size) {
-        new_size = offset + size;
-    }
-    else {
-        new_size = log_entry->inode.size;
+    // Check if current path corresponds to a directory
+    if(S_ISDIR(log_entry->inode.mode)) {
+        return -EISDIR;
     }
 
-    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-
     // Check if space exists in the log file system for this operation
-    if(sb->head + sizeof(struct wfs_log_entry) + new_size > disk_size) {
+    if(reserve_log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent)) == -1) {
         return -ENOSPC;
     }
 
-    // Construct new entry for the file that is being written to
-    struct wfs_log_entry *new_entry = (struct wfs_log_entry *)((char*)mapped_data + sb->head);
+    // Cut off the writes buffered by open files past the new end of the file, the rest are appended later as usual
+    unsigned int inode_number = log_entry->inode.inode_number;
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(write_buffer->inode_number != inode_number || write_buffer->length == 0) {
+            continue;
+        }
+        if(write_buffer->offset >= size) {
+            write_buffer->length = 0;
+        }
+        else if(write_buffer->offset + write_buffer->length > size) {
+            write_buffer->length = size - write_buffer->offset;
+        }
+    }
 
-    new_entry->inode.inode_number = log_entry->inode.inode_number;
-    new_entry->inode.deleted = 0;
-    new_entry->inode.mode = __S_IFREG;
-    new_entry->inode.uid = getuid();
-    new_entry->inode.gid = getgid();
-    new_entry->inode.flags = 0;
-    new_entry->inode.size = new_size;
-    new_entry->inode.atime = time(NULL);
-    new_entry->inode.mtime = time(NULL);
-    new_entry->inode.ctime = time(NULL);
-    new_entry->inode.links = 1;
+    // Only the size changes, the data stays where it is and the index stops at the new size
+    struct wfs_inode inode = log_entry->inode;
+    inode.size = size;
+    inode.mtime = time(NULL);
+    inode.ctime = time(NULL);
+    append_inode_update(&inode);
+    return 0;
+}
+
+static int wfs_utimens(const char *path, const struct timespec tv[2]) {
+    if(is_stats_path(path)) {
+        return -EACCES;
+    }
+
+    // Find latest log entry for the given path
+    struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
 
-    memcpy(new_entry->data, log_entry->data, log_entry->inode.size);
-    // Write buffer contents to the file
-    memcpy(new_entry->data + offset, buffer, size);
+    // Check if log entry exists
+    if(log_entry == NULL) {
+        return -ENOENT;
+    }
 
-    sb->head += sizeof(struct wfs_log_entry) + new_entry->inode.size;
+    // Append buffered writes first, since appending them later would set the modify time again
+    unsigned int inode_number = log_entry->inode.inode_number;
+    int res = flush_overlapping_buffers(inode_number, 0, buffered_file_size(&log_entry->inode), NULL);
+    if(res < 0) {
+        return res;
+    }
+    log_entry = find_latest_log_entry(inode_number);
 
-    return size;
+    // Check if space exists in the log file system for this operation, after the flush used up what it needed
+    if(reserve_log_space(sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry_update)) == -1) {
+        return -ENOSPC;
+    }
+
+    struct wfs_inode inode = log_entry->inode;
+    time_t now = time(NULL);
+    if(tv == NULL || tv[0].tv_nsec != UTIME_OMIT) {
+        inode.atime = tv == NULL || tv[0].tv_nsec == UTIME_NOW ? now : tv[0].tv_sec;
+    }
+    if(tv == NULL || tv[1].tv_nsec != UTIME_OMIT) {
+        inode.mtime = tv == NULL || tv[1].tv_nsec == UTIME_NOW ? now : tv[1].tv_sec;
+    }
+    inode.ctime = now;
+    append_inode_update(&inode);
+    return 0;
 }
 
-static int wfs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* info) {
+static int wfs_open(const char *path, struct fuse_file_info *info) {
+    // The statistics file is read-only and bypasses the page cache, which would otherwise go by its size of 0
+    if(is_stats_path(path)) {
+        if((info->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        info->direct_io = 1;
+        info->fh = 0;
+        return 0;
+    }
+
     // Find latest log entry for the given path
     struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
-    
+
     // Check if log entry exists
     if(log_entry == NULL) {
         return -ENOENT;
     }
 
-    // Check if current path corresponds to a directory
-    if(S_ISREG(log_entry->inode.mode)) {
-        return -ENOTDIR;
+    // Files opened for reading never write, so only the others get a buffer for their writes. Leaving read-only opens
+    // out of write_buffers keeps them from slowing down the scans of it on every read and getattr
+    if((info->flags & O_ACCMODE) == O_RDONLY) {
+        info->fh = 0;
+        return 0;
     }
 
-    // Extract the directory entries for the directory
-    struct wfs_dentry *entries = (struct wfs_dentry *)log_entry->data;
-    int num_entries = log_entry->inode.size / sizeof(struct wfs_dentry);
-
-    // Add entries for . and ..
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
-
-    // Iterate over the directory entries and call the filler function for each entry 
-    for (int i = 0; i < num_entries; ++i) {
-        filler(buffer, entries[i].name, NULL, 0);
+    // Give the open file a buffer for its writes
+    struct write_buffer *write_buffer = calloc(1, sizeof(struct write_buffer));
+    if(write_buffer == NULL) {
+        perror("Error allocating write buffer");
+        exit(EXIT_FAILURE);
     }
-    
+    write_buffer->inode_number = log_entry->inode.inode_number;
+    write_buffer->next = write_buffers;
+    if(write_buffers != NULL) {
+        write_buffers->prev = write_buffer;
+    }
+    write_buffers = write_buffer;
+    info->fh = (uintptr_t)write_buffer;
     return 0;
 }
 
-static int wfs_unlink(const char *path) {
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *info) {
+    if(is_stats_path(path)) {
+        return 0;
+    }
+
     // Find latest log entry for the given path
     struct wfs_log_entry *log_entry = find_log_entry_by_path(path);
-    
+
     // Check if log entry exists
     if(log_entry == NULL) {
         return -ENOENT;
     }
 
-    // Check if current path corresponds to a directory
-    if(S_ISDIR(log_entry->inode.mode)) {
-        return -EISDIR;
+    // Append what the open file buffered before committing the log
+    if(info != NULL && info->fh != 0) {
+        int res = flush_write_buffer((struct write_buffer *)(uintptr_t)info->fh);
+        if(res < 0) {
+            return res;
+        }
     }
 
-    // Separate directory name and path to the directory that the new directory is located in
-    char path_copy[MAX_PATH_NAME_LEN];
-    strncpy(path_copy, path, MAX_PATH_NAME_LEN);
-    struct wfs_path_info path_info;
-    separate_path_and_file(path_copy, &path_info);
+    // The log is only written at the head, so committing it in order covers this file and everything it depends on.
+    // The commit itself happens once fs_lock is released
+    return 0;
+}
 
-    // Find latest log entry for the parent directory
-    struct wfs_log_entry *parent_log_entry = find_log_entry_by_path(path_info.parent_path);
-    
-    // Check if parent log entry exists
-    if(parent_log_entry == NULL) {
-        return -ENOENT;
+static int wfs_flush(const char *path, struct fuse_file_info *info) {
+    // Append what the open file buffered when a descriptor is closed. Closing doesn't promise durability, which is left
+    // to fsync
+    if(info->fh == 0) {
+        return 0;
+    }
+    return flush_write_buffer((struct write_buffer *)(uintptr_t)info->fh);
+}
+
+static int wfs_release(const char *path, struct fuse_file_info *info) {
+    struct write_buffer *write_buffer = (struct write_buffer *)(uintptr_t)info->fh;
+    if(write_buffer == NULL) {
+        return 0;
+    }
+    // Closed for good, so the buffer goes away even if its writes can't be appended
+    int res = flush_write_buffer(write_buffer);
+    if(write_buffer->prev != NULL) {
+        write_buffer->prev->next = write_buffer->next;
+    }
+    else {
+        write_buffers = write_buffer->next;
+    }
+    if(write_buffer->next != NULL) {
+        write_buffer->next->prev = write_buffer->prev;
+    }
+
+    // The inode number of a removed file becomes free once the last file open for writing is gone
+    if(write_buffer->removed) {
+        int still_open = 0;
+        for(struct write_buffer *other = write_buffers; other != NULL; other = other->next) {
+            if(other->inode_number == write_buffer->inode_number) {
+                still_open = 1;
+                break;
+            }
+        }
+        if(!still_open) {
+            release_inode_number(write_buffer->inode_number);
+        }
+    }
+    free(write_buffer->data);
+    free(write_buffer);
+    info->fh = 0;
+    return res;
+}
+
+static void* wfs_init(struct fuse_conn_info *conn) {
+    // Let libfuse splice the parts of the disk image read_buf refers to into its replies instead of reading them
+    conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+
+    // Start the cleaner here rather than in main since fuse_main may fork into the background
+    cleaner_running = 1;
+    if(pthread_create(&cleaner_thread, NULL, clean_log, NULL) != 0) {
+        perror("Unable to create cleaner thread");
+        cleaner_running = 0;
     }
+    return NULL;
+}
 
-    // Mark all log entries corresponding to an inode number as deleted
-    int res = delete_log_entries(log_entry->inode.inode_number);
+static void wfs_destroy(void *private_data) {
+    pthread_mutex_lock(&cleaner_lock);
+    int running = cleaner_running;
+    // Read without cleaner_lock by a cleaning pass in progress
+    __atomic_store_n(&cleaner_running, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&cleaner_cond);
+    pthread_cond_broadcast(&cleaner_done_cond);
+    pthread_mutex_unlock(&cleaner_lock);
+    if(running) {
+        pthread_join(cleaner_thread, NULL);
+    }
 
+    // Append whatever files still open buffered, then checkpoint at unmount unless nothing was appended since the last one
     struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
-    int parent_inode_number = parent_log_entry->inode.inode_number;
-    int num_entries = parent_log_entry->inode.size / sizeof(struct wfs_dentry);
+    lock_for_append();
+    for(struct write_buffer *write_buffer = write_buffers; write_buffer != NULL; write_buffer = write_buffer->next) {
+        if(flush_write_buffer(write_buffer) < 0) {
+            fprintf(stderr, "Out of space appending buffered writes at unmount\n");
+        }
+    }
+    if(sb->checkpoint == 0 || checkpoint_age() > 0) {
+        write_checkpoint();
+    }
+    unlock_for_append();
 
-    // Check if space exists in the log file system for this operation
-    if(sb->head + sizeof(struct wfs_log_entry) + (sizeof(struct wfs_dentry) * (num_entries-1)) > disk_size) {
-        return -ENOSPC;
+    if(sync_log() == -1) {
+        perror("Error syncing disk image");
     }
+}
 
-    // Construct new log entry for the parent directory without the deleted file 
-    struct wfs_log_entry *new_entry = (struct wfs_log_entry *)((char*)mapped_data + sb->head);
-    new_entry->inode.inode_number = parent_inode_number;
-    new_entry->inode.deleted = 0;
-    new_entry->inode.mode = __S_IFDIR;
-    new_entry->inode.uid = getuid();
-    new_entry->inode.gid = getgid();
-    new_entry->inode.flags = 0;
-    new_entry->inode.size = sizeof(struct wfs_dentry) * (num_entries-1);
-    new_entry->inode.atime = time(NULL);
-    new_entry->inode.mtime = time(NULL);
-    new_entry->inode.ctime = time(NULL);
-    new_entry->inode.links = 1;
+// Helper function for operations that ran out of space to wait for a cleaning pass, returns 0 if retrying is worthwhile.
+// Must be called without holding fs_lock since the cleaner needs it
+static int wait_for_cleaner() {
+    pthread_mutex_lock(&cleaner_lock);
+    if(!cleaner_running) {
+        pthread_mutex_unlock(&cleaner_lock);
+        return -1;
+    }
 
-    struct wfs_dentry *old_entries = (struct wfs_dentry *)parent_log_entry->data;
-    struct wfs_dentry *new_entries = (struct wfs_dentry *)new_entry->data;
+    // The cleaner clears the request without starting a pass if nothing was appended since the last one
+    unsigned long passes = cleaner_passes;
+    cleaner_requested = 1;
+    pthread_cond_signal(&cleaner_cond);
+    while(cleaner_running && cleaner_requested && cleaner_passes == passes) {
+        pthread_cond_wait(&cleaner_done_cond, &cleaner_lock);
+    }
+    int res = cleaner_passes != passes ? 0 : -1;
+    pthread_mutex_unlock(&cleaner_lock);
+    return res;
+}
 
-    int curr = 0;
+// Wrappers running each operation under the filesystem lock. Operations that only read share the lock, while operations
+// appending to the log also take append_lock, hold fs_lock exclusively and retry once after a cleaning pass when the
+// disk is full
+static int wfs_locked_getattr(const char *path, struct stat *stbuf) {
+    long start_us = monotonic_us();
+    pthread_rwlock_rdlock(&fs_lock);
+    int res = wfs_getattr(path, stbuf);
+    pthread_rwlock_unlock(&fs_lock);
+    record_op(OP_GETATTR, start_us);
+    return res;
+}
 
-    for (int i = 0; i < num_entries; ++i) {
-        if(old_entries[i].inode_number == log_entry->inode.inode_number) {
-            continue;
-        }
-        new_entries[curr].inode_number = old_entries[i].inode_number;
-        memcpy(new_entries[curr].name, old_entries[i].name, MAX_FILE_NAME_LEN);
-        curr++;
+static int wfs_locked_mknod(const char *path, mode_t mode, dev_t device) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_mknod(path, mode, device);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_mknod(path, mode, device);
+        unlock_for_append();
     }
+    record_op(OP_MKNOD, start_us);
+    return res;
+}
 
+static int wfs_locked_mkdir(const char *path, mode_t mode) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_mkdir(path, mode);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_mkdir(path, mode);
+        unlock_for_append();
+    }
+    record_op(OP_MKDIR, start_us);
+    return res;
+}
 
-    sb->head += sizeof(struct wfs_log_entry) + new_entry->inode.size;
+static int wfs_locked_read(const char *path, char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
+    long start_us = monotonic_us();
+    pthread_rwlock_rdlock(&fs_lock);
+    int res = wfs_read(path, buffer, size, offset, info);
+    pthread_rwlock_unlock(&fs_lock);
+    record_op(OP_READ, start_us);
+    return res;
+}
 
-    if(res == 1) {
-        return 0;
+static int wfs_locked_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info* info) {
+    long start_us = monotonic_us();
+    // libfuse sent the reply of the previous read_buf on this thread before it took this request
+    unpin_log_ranges();
+    pthread_rwlock_rdlock(&fs_lock);
+    int res = wfs_read_buf(path, bufp, size, offset, info);
+    pthread_rwlock_unlock(&fs_lock);
+    record_op(OP_READ, start_us);
+    return res;
+}
+
+static int wfs_locked_write(const char *path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* info) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_write(path, buffer, size, offset, info);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_write(path, buffer, size, offset, info);
+        unlock_for_append();
+    }
+    record_op(OP_WRITE, start_us);
+    return res;
+}
+
+static int wfs_locked_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* info) {
+    long start_us = monotonic_us();
+    pthread_rwlock_rdlock(&fs_lock);
+    int res = wfs_readdir(path, buffer, filler, offset, info);
+    pthread_rwlock_unlock(&fs_lock);
+    record_op(OP_READDIR, start_us);
+    return res;
+}
+
+static int wfs_locked_unlink(const char *path) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_unlink(path);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_unlink(path);
+        unlock_for_append();
+    }
+    record_op(OP_UNLINK, start_us);
+    return res;
+}
+
+static int wfs_locked_rmdir(const char *path) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_rmdir(path);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_rmdir(path);
+        unlock_for_append();
+    }
+    record_op(OP_RMDIR, start_us);
+    return res;
+}
+
+static int wfs_locked_rename(const char *from, const char *to) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_rename(from, to);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_rename(from, to);
+        unlock_for_append();
+    }
+    record_op(OP_RENAME, start_us);
+    return res;
+}
+
+static int wfs_locked_truncate(const char *path, off_t size) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_truncate(path, size);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_truncate(path, size);
+        unlock_for_append();
+    }
+    record_op(OP_TRUNCATE, start_us);
+    return res;
+}
+
+static int wfs_locked_utimens(const char *path, const struct timespec tv[2]) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_utimens(path, tv);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_utimens(path, tv);
+        unlock_for_append();
+    }
+    record_op(OP_UTIMENS, start_us);
+    return res;
+}
+
+static int wfs_locked_open(const char *path, struct fuse_file_info *info) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_open(path, info);
+    unlock_for_append();
+    record_op(OP_OPEN, start_us);
+    return res;
+}
+
+static int wfs_locked_fsync(const char *path, int datasync, struct fuse_file_info *info) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_fsync(path, datasync, info);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_fsync(path, datasync, info);
+        unlock_for_append();
+    }
+    if(res == 0 && sync_log() == -1) {
+        res = -EIO;
     }
-    return -ENOENT;
+    record_op(OP_FSYNC, start_us);
+    return res;
+}
+
+static int wfs_locked_flush(const char *path, struct fuse_file_info *info) {
+    long start_us = monotonic_us();
+    lock_for_append();
+    int res = wfs_flush(path, info);
+    unlock_for_append();
+    if(res == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        res = wfs_flush(path, info);
+        unlock_for_append();
+    }
+    record_op(OP_FLUSH, start_us);
+    return res;
+}
+
+static int wfs_locked_release(const char *path, struct fuse_file_info *info) {
+    long start_us = monotonic_us();
+    // Flushing first gets the retry after a cleaning pass before the buffer is dropped
+    lock_for_append();
+    int flushed = wfs_flush(path, info);
+    unlock_for_append();
+    if(flushed == -ENOSPC && wait_for_cleaner() == 0) {
+        lock_for_append();
+        wfs_flush(path, info);
+        unlock_for_append();
+    }
+    lock_for_append();
+    int res = wfs_release(path, info);
+    unlock_for_append();
+    record_op(OP_RELEASE, start_us);
+    return res;
 }
 
 static struct fuse_operations ops = {
-    .getattr	= wfs_getattr,
-    .mknod      = wfs_mknod,
-    .mkdir      = wfs_mkdir,
-    .read	    = wfs_read,
-    .write      = wfs_write,
-    .readdir	= wfs_readdir,
-    .unlink    	= wfs_unlink,
+    .getattr	= wfs_locked_getattr,
+    .mknod      = wfs_locked_mknod,
+    .open       = wfs_locked_open,
+    .mkdir      = wfs_locked_mkdir,
+    .read	    = wfs_locked_read,
+    .read_buf   = wfs_locked_read_buf,
+    .write      = wfs_locked_write,
+    .readdir	= wfs_locked_readdir,
+    .unlink    	= wfs_locked_unlink,
+    .rmdir      = wfs_locked_rmdir,
+    .rename     = wfs_locked_rename,
+    .truncate   = wfs_locked_truncate,
+    .utimens    = wfs_locked_utimens,
+    .fsync      = wfs_locked_fsync,
+    .fsyncdir   = wfs_locked_fsync,
+    .flush      = wfs_locked_flush,
+    .release    = wfs_locked_release,
+    .init       = wfs_init,
+    .destroy    = wfs_destroy,
 };
 
 
+// Options of mount.wfs given with -o among the FUSE options
+static struct fuse_opt wfs_opts[] = {
+    { "dedup", offsetof(struct wfs_options, dedup), 1 },
+    { "compress", offsetof(struct wfs_options, compress), 1 },
+    FUSE_OPT_END
+};
+
 int main(int argc, char *argv[]) {
-    
+    // Take the options of mount.wfs out of the arguments before they are passed on to fuse_main
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, wfs_opts, NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    // Every change to the disk image goes through this mount, so the kernel can keep looked up names and attributes far
+    // longer than the default of a second. Inserted ahead of the other options so that the ones given still win
+    if (fuse_opt_insert_arg(&args, 1, "-oentry_timeout=" ENTRY_TIMEOUT ",attr_timeout=" ATTR_TIMEOUT) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    argc = args.argc;
+    argv = args.argv;
+
     const char *disk_path = argv[argc-2];
 
     // Open the disk file
@@ -545,13 +3762,37 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Map the contents of the disk to memory using mmap
-    mapped_data = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (mapped_data == MAP_FAILED) {
+    // Reserve address space for the disk image to grow into, then map the contents of the disk to the start of it
+    mapping_size = disk_size > MAX_DISK_SIZE ? disk_size : MAX_DISK_SIZE;
+    mapped_data = mmap(NULL, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped_data == MAP_FAILED || mmap(mapped_data, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
         perror("Error mapping disk file into memory");
         close(fd);
         exit(EXIT_FAILURE);
     }
+
+    // Refuse images formatted by an incompatible version of mkfs.wfs, older images are upgraded by fsck.wfs
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_data;
+    if (sb->magic != WFS_MAGIC || sb->version < WFS_MIN_VERSION || sb->version > WFS_VERSION || !wfs_valid_alignment(sb)) {
+        fprintf(stderr, "Disk image is not a version %d to %d wfs filesystem, older images can be upgraded with fsck.wfs\n", WFS_MIN_VERSION, WFS_VERSION);
+        munmap(mapped_data, mapping_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Find the most recent log entry of every inode once instead of on every lookup
+    build_inode_index();
+    build_free_inode_list();
+    init_chunk_gear();
+    build_chunk_index();
+    clear_decompress_cache();
+    dirty_offset = sb->head;
+    mount_head = sb->head;
+    if(pthread_key_create(&read_pins_key, free_read_pins) != 0) {
+        perror("Error creating read pins key");
+        exit(EXIT_FAILURE);
+    }
+
     // Modify the arguments before passing them to fuse_main
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
@@ -559,7 +3800,7 @@ int main(int argc, char *argv[]) {
     fuse_main(argc, argv, &ops, NULL);
     
     // Unmap the memory mapping
-    if (munmap(mapped_data, disk_size) == -1) {
+    if (munmap(mapped_data, mapping_size) == -1) {
         perror("Error unmapping memory");
         close(fd);
         exit(EXIT_FAILURE);
@@ -567,5 +3808,14 @@ int main(int argc, char *argv[]) {
 
     // Close the disk file
     close(fd);
+    for(int i = 0; i < inode_index_capacity; i++) {
+        clear_inode_info(i);
+    }
+    free(inode_index);
+    free(free_inodes);
+    free(chunk_entries);
+    free(chunk_buckets);
+    clear_decompress_cache();
+    fuse_opt_free_args(&args);
     return 0;
 }
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#define READ_SIZE 4096
+
+// Arguments and results of a reader thread
+struct reader {
+    pthread_t thread;
+    int fd;
+    size_t file_size;
+    unsigned int seed;
+    long reads;
+    long bytes;
+};
+
+// Arguments and results of the writer thread
+struct writer {
+    pthread_t thread;
+    int fd;
+    size_t file_size;
+    size_t write_size;
+    long bytes;
+};
+
+// Global variables shared by the reader and writer threads
+volatile int stop_readers;
+
+// Helper function to find the time elapsed between two timespecs in seconds
+double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+// Function executed by each reader thread, which reads random blocks of its file until told to stop
+void *read_file(void *arg) {
+    struct reader *reader = (struct reader *)arg;
+    char buffer[READ_SIZE];
+    size_t num_blocks = reader->file_size / READ_SIZE;
+
+    while (!stop_readers) {
+        off_t offset = (off_t)(rand_r(&reader->seed) % num_blocks) * READ_SIZE;
+        ssize_t bytes_read = pread(reader->fd, buffer, READ_SIZE, offset);
+        if (bytes_read < 0) {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        reader->reads++;
+        reader->bytes += bytes_read;
+    }
+    return NULL;
+}
+
+// Function executed by the writer thread, which keeps overwriting its file with writes of write_size bytes until told to
+// stop, so that every write appends a log entry while the readers run
+void *write_file(void *arg) {
+    struct writer *writer = (struct writer *)arg;
+    char *buffer = malloc(writer->write_size);
+    if (buffer == NULL) {
+        perror("Error allocating write buffer");
+        exit(EXIT_FAILURE);
+    }
+    memset(buffer, 'w', writer->write_size);
+
+    off_t offset = 0;
+    while (!stop_readers) {
+        ssize_t bytes_written = pwrite(writer->fd, buffer, writer->write_size, offset);
+        if (bytes_written < 0) {
+            perror("Error writing file");
+            exit(EXIT_FAILURE);
+        }
+        // Write through to mount.wfs every time instead of letting the file buffer grow
+        fsync(writer->fd);
+        writer->bytes += bytes_written;
+        offset = (offset + writer->write_size) % writer->file_size;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Helper function to create a file of the given size filled with data under the mount point
+void create_file(const char *path, size_t file_size) {
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+
+    char buffer[READ_SIZE];
+    for (size_t offset = 0; offset < file_size; offset += READ_SIZE) {
+        memset(buffer, 'a' + (offset / READ_SIZE) % 26, READ_SIZE);
+        if (pwrite(fd, buffer, READ_SIZE, offset) != READ_SIZE) {
+            perror("Error writing file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    // Check if right number of arguments are provided
+    if (argc < 2 || argc > 6) {
+        printf("Usage: %s <mount_point> [max_threads] [file_size_kb] [seconds] [write_kb]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *mount_point = argv[1];
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    size_t file_size = (argc > 3 ? atoi(argv[3]) : 64) * 1024;
+    double seconds = argc > 4 ? atof(argv[4]) : 2;
+    // Size of the writes of a writer thread running alongside the readers, 0 for none
+    size_t write_size = (argc > 5 ? atoi(argv[5]) : 0) * 1024;
+    if (max_threads < 1 || file_size < READ_SIZE || seconds <= 0 || write_size > file_size) {
+        printf("Usage: %s <mount_point> [max_threads] [file_size_kb] [seconds] [write_kb]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Give every reader its own file so that only the filesystem is shared between them
+    char (*paths)[256] = malloc(max_threads * sizeof(*paths));
+    struct reader *readers = malloc(max_threads * sizeof(struct reader));
+    if (paths == NULL || readers == NULL) {
+        perror("Error allocating readers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < max_threads; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/readbench.%d", mount_point, i);
+        create_file(paths[i], file_size);
+    }
+    char writer_path[256];
+    snprintf(writer_path, sizeof(writer_path), "%s/readbench.writer", mount_point);
+    struct writer writer;
+    if (write_size > 0) {
+        create_file(writer_path, file_size);
+    }
+
+    printf("threads,reads_per_sec,mb_per_sec,write_mb_per_sec\n");
+    // Double the number of readers every round, finishing with max_threads
+    int num_threads = 1;
+    while (1) {
+        stop_readers = 0;
+        for (int i = 0; i < num_threads; i++) {
+            readers[i].fd = open(paths[i], O_RDONLY);
+            if (readers[i].fd == -1) {
+                perror("Error opening file");
+                exit(EXIT_FAILURE);
+            }
+            readers[i].file_size = file_size;
+            readers[i].seed = i + 1;
+            readers[i].reads = 0;
+            readers[i].bytes = 0;
+        }
+
+        if (write_size > 0) {
+            writer.fd = open(writer_path, O_WRONLY);
+            if (writer.fd == -1) {
+                perror("Error opening file");
+                exit(EXIT_FAILURE);
+            }
+            writer.file_size = file_size;
+            writer.write_size = write_size;
+            writer.bytes = 0;
+        }
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        if (write_size > 0 && pthread_create(&writer.thread, NULL, write_file, &writer) != 0) {
+            perror("Unable to create writer thread");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            if (pthread_create(&readers[i].thread, NULL, read_file, &readers[i]) != 0) {
+                perror("Unable to create reader thread");
+                exit(EXIT_FAILURE);
+            }
+        }
+        usleep(seconds * 1000000);
+        stop_readers = 1;
+
+        long reads = 0;
+        long bytes = 0;
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(readers[i].thread, NULL);
+            close(readers[i].fd);
+            reads += readers[i].reads;
+            bytes += readers[i].bytes;
+        }
+        long bytes_written = 0;
+        if (write_size > 0) {
+            pthread_join(writer.thread, NULL);
+            close(writer.fd);
+            bytes_written = writer.bytes;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+        double elapsed = elapsed_seconds(&start_time, &end_time);
+        printf("%d,%.0f,%.1f,%.1f\n", num_threads, reads / elapsed, bytes / elapsed / (1024 * 1024),
+               bytes_written / elapsed / (1024 * 1024));
+
+        if (num_threads == max_threads) {
+            break;
+        }
+        num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads;
+    }
+
+    for (int i = 0; i < max_threads; i++) {
+        unlink(paths[i]);
+    }
+    if (write_size > 0) {
+        unlink(writer_path);
+    }
+    free(paths);
+    free(readers);
+    return 0;
+}
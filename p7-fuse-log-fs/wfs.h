@@ -1,5 +1,7 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #ifndef MOUNT_WFS_H_
 #define MOUNT_WFS_H_
@@ -7,10 +9,36 @@
 #define MAX_FILE_NAME_LEN 32
 #define MAX_PATH_NAME_LEN 128
 #define WFS_MAGIC 0xdeadbeef
+#define WFS_VERSION 9           // bumped whenever the on-disk format changes
+#define WFS_MIN_VERSION 9       // oldest version that can be mounted, fsck.wfs upgrades older images
+#define WFS_ALIGNMENT 8         // every log entry starts at a multiple of this, images can ask for more in the superblock
+#define WFS_CACHE_LINE_SIZE 64  // alignment of log entries on images made with mkfs.wfs -a
+#define WFS_PAGE_SIZE 4096      // alignment of large file data on images made with mkfs.wfs -a
+#define WFS_MAX_ALIGNMENT (1024 * 1024) // largest alignment mount.wfs and fsck.wfs accept from a superblock
+
+// Values for the flags field of struct wfs_inode
+#define WFS_INODE_EXTENT 0x1    // log entry holds a single written extent instead of the whole file
+#define WFS_INODE_CHECKPOINT 0x2 // log entry holds a checkpoint of the inode map, always marked deleted
+#define WFS_INODE_DENTRY 0x4    // log entry adds or removes a single directory entry instead of holding the whole directory
+#define WFS_INODE_CHUNK 0x8     // log entry holds a chunk of file data that files share by referencing its inode number
+#define WFS_INODE_CHUNKED 0x10  // data of the log entry is a list of chunk references instead of the bytes themselves
+#define WFS_INODE_COMPRESSED 0x20 // file data of the log entry is stored as a struct wfs_compressed
+#define WFS_INODE_TOMBSTONE 0x40 // log entry without data marking every earlier entry of the inode as removed
+#define WFS_INODE_PADDING 0x80  // deleted log entry covering dead space left by the cleaner, only its header is checksummed
+#define WFS_INODE_FLAGS 0xff    // every flag above
+
+// Values for the op field of struct wfs_dentry_update
+#define WFS_DENTRY_ADD 1
+#define WFS_DENTRY_REMOVE 2
+#define WFS_DENTRY_NONE 3       // changes no entry, only the inode of the directory such as its times
 
 struct wfs_sb {
     uint32_t magic;
-    uint32_t head;
+    uint32_t version;
+    uint64_t head;
+    uint64_t checkpoint;        // offset of the log entry holding the most recent checkpoint, 0 if there is none
+    uint32_t alignment;         // log entries start at and take up multiples of this, at least WFS_ALIGNMENT
+    uint32_t data_alignment;    // file data of at least this many bytes starts at a multiple of it instead, 0 if none
 };
 
 // Struct to store path info for a file such as filename and directory it is located in
@@ -26,11 +54,13 @@ struct wfs_inode {
     unsigned int uid;           // user id
     unsigned int gid;           // group id
     unsigned int flags;         // flags
-    unsigned int size;          // size in bytes
+    uint64_t size;              // size in bytes (of the whole file, even for extent log entries)
     unsigned int atime;         // last access time
     unsigned int mtime;         // last modify time
     unsigned int ctime;         // inode change time (the last time any field of inode is modified)
     unsigned int links;         // number of hard links to this file (this can always be set to 1)
+    uint32_t checksum;          // wfs_checksum of the log entry
+    uint32_t reserved;
 };
 
 struct wfs_dentry {
@@ -43,4 +73,302 @@ struct wfs_log_entry {
     char data[];
 };
 
+// Payload of an extent log entry, followed by length bytes written at offset within the file. Extents of length 0
+// only change the inode, such as the size after a truncate or the times, and have the size of the file as offset
+struct wfs_extent {
+    uint64_t offset;
+    uint64_t length;
+    char data[];
+};
+
+// Payload of a chunk log entry, followed by inode.size bytes of file data
+struct wfs_chunk {
+    uint64_t hash;
+    char data[];
+};
+
+// Reference to a chunk from a chunked log entry
+struct wfs_chunk_ref {
+    uint64_t offset;            // offset of the chunk within the data of the referencing log entry
+    uint32_t inode_number;      // inode number of the chunk log entry holding the bytes
+    uint32_t length;
+};
+
+// Payload of a chunked log entry. The first two fields match struct wfs_extent, and chunked log entries holding the
+// whole file have offset 0 and the size of the file as length
+struct wfs_chunk_list {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t num_chunks;
+    struct wfs_chunk_ref chunks[];
+};
+
+// File data of a compressed log entry, in place of the bytes themselves. Sequences of a literal run followed by a match,
+// each starting with a token whose high and low 4 bits hold the literal length and the match length minus 4. A value of
+// 15 continues in the following bytes, added up until one below 255. The literals come next, then the 16-bit little
+// endian distance back to the match. The last sequence only has literals
+struct wfs_compressed {
+    uint64_t length;            // compressed length
+    char data[];
+};
+
+// Payload of a directory entry update log entry
+struct wfs_dentry_update {
+    uint32_t op;
+    uint32_t reserved;
+    struct wfs_dentry dentry;
+};
+
+// Payload of a checkpoint log entry, followed by num_inodes wfs_imap_entry and then num_extents wfs_imap_extent.
+// Log entries after the checkpoint entry are replayed on top of it at mount
+struct wfs_checkpoint {
+    uint32_t max_inode_number;
+    uint32_t num_inodes;
+    uint32_t num_extents;
+    uint32_t reserved;
+    char data[];
+};
+
+// Inode map record of a checkpoint, whose extents follow those of the previous records. For directories the extents are
+// the directory entry updates appended after base, with only entry_offset set
+struct wfs_imap_entry {
+    uint32_t inode_number;
+    uint32_t num_extents;
+    uint64_t latest;            // offset of the most recent log entry of the inode
+    uint64_t base;              // offset of the most recent log entry holding the whole file, 0 if there is none
+};
+
+// Range of a file whose current contents live in an extent log entry
+struct wfs_imap_extent {
+    uint64_t file_offset;
+    uint64_t length;
+    uint64_t entry_offset;      // offset of the extent log entry holding the bytes
+    uint64_t data_offset;       // offset of the bytes within the data of that extent
+};
+
+// Round a number of bytes up to a power of two alignment
+static inline size_t wfs_align(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(size_t)(alignment - 1);
+}
+
+// Check that the alignments in a superblock are powers of two that log entries can be laid out with
+static inline int wfs_valid_alignment(const struct wfs_sb *sb) {
+    if (sb->alignment < WFS_ALIGNMENT || sb->alignment > WFS_MAX_ALIGNMENT || (sb->alignment & (sb->alignment - 1))) {
+        return 0;
+    }
+    return sb->data_alignment == 0 || (sb->data_alignment >= sb->alignment && sb->data_alignment <= WFS_MAX_ALIGNMENT &&
+                                       !(sb->data_alignment & (sb->data_alignment - 1)));
+}
+
+// Offset of the first log entry, right after the superblock
+static inline size_t wfs_log_start(const struct wfs_sb *sb) {
+    return wfs_align(sizeof(struct wfs_sb), sb->alignment);
+}
+
+// Number of bytes length bytes of file data take up at data within a log entry, less if the entry is compressed
+static inline size_t wfs_data_size(const struct wfs_inode *inode, const char *data, size_t length) {
+    if (inode->flags & WFS_INODE_COMPRESSED) {
+        return sizeof(struct wfs_compressed) + ((const struct wfs_compressed *)data)->length;
+    }
+    return length;
+}
+
+// Number of bytes of the data following the header of a log entry with the given inode, padding not included
+static inline size_t wfs_payload_size(const struct wfs_inode *inode, const char *data) {
+    if (inode->flags & WFS_INODE_CHUNKED) {
+        const struct wfs_chunk_list *list = (const struct wfs_chunk_list *)data;
+        return sizeof(struct wfs_chunk_list) + list->num_chunks * sizeof(struct wfs_chunk_ref);
+    }
+    if (inode->flags & WFS_INODE_EXTENT) {
+        const struct wfs_extent *extent = (const struct wfs_extent *)data;
+        return sizeof(struct wfs_extent) + wfs_data_size(inode, extent->data, extent->length);
+    }
+    if (inode->flags & WFS_INODE_DENTRY) {
+        return sizeof(struct wfs_dentry_update);
+    }
+    if (inode->flags & WFS_INODE_CHUNK) {
+        const struct wfs_chunk *chunk = (const struct wfs_chunk *)data;
+        return sizeof(struct wfs_chunk) + wfs_data_size(inode, chunk->data, inode->size);
+    }
+    return wfs_data_size(inode, data, inode->size);
+}
+
+// Offset of the file data a log entry stores as is from the start of the entry, 0 if it holds none that way such as
+// compressed or chunked data. Sets length to the number of bytes of that data
+static inline size_t wfs_file_data_offset(const struct wfs_log_entry *log_entry, size_t *length) {
+    const struct wfs_inode *inode = &log_entry->inode;
+    if (inode->flags & (WFS_INODE_CHECKPOINT | WFS_INODE_DENTRY | WFS_INODE_CHUNKED | WFS_INODE_COMPRESSED |
+                        WFS_INODE_TOMBSTONE | WFS_INODE_PADDING)) {
+        return 0;
+    }
+    if (inode->flags & WFS_INODE_EXTENT) {
+        *length = ((const struct wfs_extent *)log_entry->data)->length;
+        return sizeof(struct wfs_log_entry) + sizeof(struct wfs_extent);
+    }
+    if (inode->flags & WFS_INODE_CHUNK) {
+        *length = inode->size;
+        return sizeof(struct wfs_log_entry) + sizeof(struct wfs_chunk);
+    }
+    if (!S_ISREG(inode->mode)) {
+        return 0;
+    }
+    *length = inode->size;
+    return sizeof(struct wfs_log_entry);
+}
+
+// Check if a log entry holding length bytes of file data at data_offset starts where that data is aligned to
+// data_alignment instead of at a multiple of alignment
+static inline int wfs_data_aligned(const struct wfs_sb *sb, size_t data_offset, size_t length) {
+    return sb->data_alignment != 0 && data_offset != 0 && length >= sb->data_alignment;
+}
+
+// Number of bytes a log entry holding length bytes of file data at data_offset takes up on disk, padding up to the next
+// entry included. Entries without file data pass 0 as data_offset and their whole size as length. Entries with aligned
+// data are padded so that they end at a multiple of alignment
+static inline size_t wfs_entry_size(const struct wfs_sb *sb, size_t data_offset, size_t length) {
+    if (wfs_data_aligned(sb, data_offset, length)) {
+        return data_offset + wfs_align(length, sb->alignment);
+    }
+    return wfs_align(data_offset + length, sb->alignment);
+}
+
+// Number of bytes a log entry occupies on disk, header and padding up to the next entry included. Padding entries fill
+// the gap in front of entries with aligned data exactly, so they only keep to WFS_ALIGNMENT
+static inline size_t wfs_log_entry_size(const struct wfs_log_entry *log_entry, const struct wfs_sb *sb) {
+    if (log_entry->inode.flags & WFS_INODE_PADDING) {
+        return wfs_align(sizeof(struct wfs_log_entry) + log_entry->inode.size, WFS_ALIGNMENT);
+    }
+    size_t length;
+    size_t data_offset = wfs_file_data_offset(log_entry, &length);
+    if (data_offset == 0) {
+        length = sizeof(struct wfs_log_entry) + wfs_payload_size(&log_entry->inode, log_entry->data);
+    }
+    return wfs_entry_size(sb, data_offset, length);
+}
+
+// Offset at or after offset where a log entry holding length bytes of file data at data_offset is placed, leaving room
+// for a padding entry in front of it if it doesn't start at offset
+static inline size_t wfs_entry_offset(const struct wfs_sb *sb, size_t offset, size_t data_offset, size_t length) {
+    size_t alignment = sb->alignment;
+    size_t start = wfs_align(offset, alignment);
+    if (wfs_data_aligned(sb, data_offset, length)) {
+        alignment = sb->data_alignment;
+        start = wfs_align(offset + data_offset, alignment) - data_offset;
+    }
+    if (start != offset && start - offset < sizeof(struct wfs_log_entry)) {
+        start += wfs_align(sizeof(struct wfs_log_entry), alignment);
+    }
+    return start;
+}
+
+// Size the log entry at offset within the log starting at log claims, 0 unless its header is well formed and the entry
+// fits before end. Lengths are checked against end before they are added up, so garbage can't make the size overflow.
+// The log starts with the superblock, whose alignment must have been checked
+static inline size_t wfs_plausible_log_entry_size(const char *log, uint64_t offset, uint64_t end);
+
+// Size of the log entry at offset within the log starting at log, 0 unless wfs_plausible_log_entry_size accepts it and
+// it matches its checksum
+static inline size_t wfs_valid_log_entry_size(const char *log, uint64_t offset, uint64_t end);
+
+// Multiply-xor hash of length bytes, 8 at a time, continuing from hash
+static inline uint64_t wfs_hash(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    for (; length > 0; bytes++, length--) {
+        hash = (hash ^ *bytes) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Hash of a log entry over its header and data that its checksum is folded from. The checksum field and deleted are
+// taken as 0, since entries are marked deleted in place
+static inline uint64_t wfs_entry_hash(const struct wfs_log_entry *log_entry) {
+    struct wfs_inode inode;
+    memcpy(&inode, &log_entry->inode, sizeof(struct wfs_inode));
+    inode.checksum = 0;
+    inode.deleted = 0;
+    uint64_t hash = wfs_hash(0x243f6a8885a308d3ULL, &inode, sizeof(struct wfs_inode));
+    if (!(inode.flags & WFS_INODE_PADDING)) {
+        hash = wfs_hash(hash, log_entry->data, wfs_payload_size(&inode, log_entry->data));
+    }
+    return hash;
+}
+
+// Checksum of a log entry over its header and data, which tells a complete entry apart from a torn one or from
+// anything that isn't an entry. The last multiply spreads every bit of the hash into the upper half that is kept
+static inline uint32_t wfs_checksum(const struct wfs_log_entry *log_entry) {
+    return (uint32_t)((wfs_entry_hash(log_entry) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static inline size_t wfs_plausible_log_entry_size(const char *log, uint64_t offset, uint64_t end) {
+    if (offset + sizeof(struct wfs_log_entry) > end) {
+        return 0;
+    }
+    const struct wfs_log_entry *log_entry = (const struct wfs_log_entry *)(log + offset);
+    const struct wfs_inode *inode = &log_entry->inode;
+    uint64_t available = end - offset - sizeof(struct wfs_log_entry);
+    if (inode->flags & ~WFS_INODE_FLAGS) {
+        return 0;
+    }
+
+    // Find the lengths wfs_payload_size adds up, making sure the fields holding them are within the entry
+    uint64_t fixed = 0;
+    uint64_t length = inode->size;
+    const char *data = log_entry->data;
+    if (inode->flags & WFS_INODE_PADDING) {
+        fixed = 0;
+    }
+    else if (inode->flags & WFS_INODE_CHUNKED) {
+        if (available < sizeof(struct wfs_chunk_list)) {
+            return 0;
+        }
+        fixed = sizeof(struct wfs_chunk_list);
+        uint64_t num_chunks = ((const struct wfs_chunk_list *)data)->num_chunks;
+        length = num_chunks > available ? available + 1 : num_chunks * sizeof(struct wfs_chunk_ref);
+    }
+    else if (inode->flags & WFS_INODE_EXTENT) {
+        if (available < sizeof(struct wfs_extent)) {
+            return 0;
+        }
+        fixed = sizeof(struct wfs_extent);
+        length = ((const struct wfs_extent *)data)->length;
+        data += sizeof(struct wfs_extent);
+    }
+    else if (inode->flags & WFS_INODE_DENTRY) {
+        length = sizeof(struct wfs_dentry_update);
+    }
+    else if (inode->flags & WFS_INODE_CHUNK) {
+        fixed = sizeof(struct wfs_chunk);
+        data += sizeof(struct wfs_chunk);
+    }
+    if (!(inode->flags & (WFS_INODE_PADDING | WFS_INODE_CHUNKED | WFS_INODE_DENTRY)) && (inode->flags & WFS_INODE_COMPRESSED)) {
+        if (available < fixed + sizeof(struct wfs_compressed)) {
+            return 0;
+        }
+        fixed += sizeof(struct wfs_compressed);
+        length = ((const struct wfs_compressed *)data)->length;
+    }
+    if (fixed > available || length > available - fixed) {
+        return 0;
+    }
+
+    size_t size = wfs_log_entry_size(log_entry, (const struct wfs_sb *)log);
+    return size <= end - offset ? size : 0;
+}
+
+static inline size_t wfs_valid_log_entry_size(const char *log, uint64_t offset, uint64_t end) {
+    const struct wfs_log_entry *log_entry = (const struct wfs_log_entry *)(log + offset);
+    size_t size = wfs_plausible_log_entry_size(log, offset, end);
+    if (size == 0 || log_entry->inode.checksum != wfs_checksum(log_entry)) {
+        return 0;
+    }
+    return size;
+}
+
 #endif
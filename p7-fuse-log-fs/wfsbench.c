@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define SMALL_IO_SIZE 4096
+#define LARGE_IO_SIZE (1024 * 1024)
+#define NUM_CREATES 1000
+#define LATENCY_REPS 1000           // operations averaged for every latency measurement
+#define LOG_STEP_SIZE (4 * 1024 * 1024)
+
+// Global path of the directory under the mount point that the benchmarks work in
+char bench_dir[256];
+
+// Helper function to find the time elapsed between two timespecs in seconds
+double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+// Helper function to read the monotonic clock
+struct timespec now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time;
+}
+
+// Helper function to print a line of results
+void report(const char *benchmark, long parameter, double value, const char *unit) {
+    printf("%s,%ld,%.3f,%s\n", benchmark, parameter, value, unit);
+    fflush(stdout);
+}
+
+// Helper function to create a directory under the benchmark directory
+void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1) {
+        perror("Error creating directory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Helper function to create an empty file
+void create_file(const char *path) {
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// Helper function to write a file of the given size sequentially in blocks of io_size, returns the seconds it took
+// including the fsync that makes it reach the disk image
+double write_file(const char *path, size_t file_size, size_t io_size) {
+    char *buffer = malloc(io_size);
+    if (buffer == NULL) {
+        perror("Error allocating buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start_time = now();
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t offset = 0; offset < file_size; offset += io_size) {
+        // Text-like contents that differ from block to block
+        for (size_t i = 0; i < io_size; i++) {
+            buffer[i] = 'a' + (offset / 64 + i) % 26;
+        }
+        if (pwrite(fd, buffer, io_size, offset) != io_size) {
+            perror("Error writing file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    struct timespec end_time = now();
+
+    free(buffer);
+    return elapsed_seconds(&start_time, &end_time);
+}
+
+// Helper function to read a file sequentially in blocks of io_size, returns the seconds it took
+double read_file(const char *path, size_t file_size, size_t io_size) {
+    char *buffer = malloc(io_size);
+    if (buffer == NULL) {
+        perror("Error allocating buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start_time = now();
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t offset = 0; offset < file_size; offset += io_size) {
+        if (pread(fd, buffer, io_size, offset) != io_size) {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    struct timespec end_time = now();
+
+    free(buffer);
+    return elapsed_seconds(&start_time, &end_time);
+}
+
+// Benchmark of the number of empty files created per second in a fresh directory
+void bench_create() {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/create", bench_dir);
+    make_dir(dir);
+
+    struct timespec start_time = now();
+    for (int i = 0; i < NUM_CREATES; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        create_file(path);
+    }
+    struct timespec end_time = now();
+    report("create", NUM_CREATES, NUM_CREATES / elapsed_seconds(&start_time, &end_time), "files_per_sec");
+}
+
+// Benchmark of sequential write and read throughput with small and large requests
+void bench_sequential(size_t file_size) {
+    size_t io_sizes[] = { SMALL_IO_SIZE, LARGE_IO_SIZE };
+    for (int i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/seq%zu", bench_dir, io_sizes[i]);
+        double mb = file_size / (1024.0 * 1024.0);
+        report("write_seq", io_sizes[i], mb / write_file(path, file_size, io_sizes[i]), "mb_per_sec");
+        report("read_seq", io_sizes[i], mb / read_file(path, file_size, io_sizes[i]), "mb_per_sec");
+    }
+}
+
+// Helper function to find the average latency of listing a directory in microseconds
+double readdir_latency(const char *dir, int reps) {
+    struct timespec start_time = now();
+    for (int i = 0; i < reps; i++) {
+        DIR *stream = opendir(dir);
+        if (stream == NULL) {
+            perror("Error opening directory");
+            exit(EXIT_FAILURE);
+        }
+        while (readdir(stream) != NULL) {
+        }
+        closedir(stream);
+    }
+    struct timespec end_time = now();
+    return elapsed_seconds(&start_time, &end_time) * 1000000 / reps;
+}
+
+// Helper function to find the average latency of stat on random files named f0 to f<num_files - 1> in microseconds
+double stat_latency(const char *dir, int num_files, int reps) {
+    unsigned int seed = 1;
+    struct timespec start_time = now();
+    for (int i = 0; i < reps; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/f%d", dir, rand_r(&seed) % num_files);
+        struct stat st;
+        if (stat(path, &st) == -1) {
+            perror("Error getting file attributes");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct timespec end_time = now();
+    return elapsed_seconds(&start_time, &end_time) * 1000000 / reps;
+}
+
+// Benchmark of readdir and stat latency as a directory grows ten times at a time up to max_entries
+void bench_directory(int max_entries) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/dir", bench_dir);
+    make_dir(dir);
+
+    int num_entries = 0;
+    for (int size = 10; size <= max_entries; size *= 10) {
+        for (; num_entries < size; num_entries++) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/f%d", dir, num_entries);
+            create_file(path);
+        }
+        // Listing a big directory takes long enough that fewer repetitions do
+        int reps = LATENCY_REPS * 10 / size > 10 ? LATENCY_REPS * 10 / size : 10;
+        report("readdir", size, readdir_latency(dir, reps), "us");
+        report("stat", size, stat_latency(dir, size, LATENCY_REPS), "us");
+    }
+}
+
+// Helper function to find the average latency of reading a small block of a file in microseconds
+double small_read_latency(const char *path, int reps) {
+    char buffer[SMALL_IO_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+    struct timespec start_time = now();
+    for (int i = 0; i < reps; i++) {
+        if (pread(fd, buffer, SMALL_IO_SIZE, 0) != SMALL_IO_SIZE) {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct timespec end_time = now();
+    close(fd);
+    return elapsed_seconds(&start_time, &end_time) * 1000000 / reps;
+}
+
+// Benchmark of stat and read latency of a file a few directories deep as the log grows by LOG_STEP_SIZE at a time up to
+// max_log_size, with files that stay live so that cleaning can't shrink it
+void bench_log_length(size_t max_log_size) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/a", bench_dir);
+    make_dir(dir);
+    strcat(dir, "/b");
+    make_dir(dir);
+    strcat(dir, "/c");
+    make_dir(dir);
+    char probe[1024];
+    snprintf(probe, sizeof(probe), "%s/f0", dir);
+    write_file(probe, SMALL_IO_SIZE, SMALL_IO_SIZE);
+
+    for (size_t log_size = 0; log_size <= max_log_size; log_size += LOG_STEP_SIZE) {
+        if (log_size > 0) {
+            char filler[512];
+            snprintf(filler, sizeof(filler), "%s/fill%zu", bench_dir, log_size / LOG_STEP_SIZE);
+            write_file(filler, LOG_STEP_SIZE, LARGE_IO_SIZE);
+        }
+        report("stat_log", log_size / (1024 * 1024), stat_latency(dir, 1, LATENCY_REPS), "us");
+        report("read_log", log_size / (1024 * 1024), small_read_latency(probe, LATENCY_REPS), "us");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // Check if right number of arguments are provided
+    if (argc < 2 || argc > 5) {
+        printf("Usage: %s <mount_point> [file_size_mb] [max_dir_entries] [max_log_mb]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *mount_point = argv[1];
+    size_t file_size = (size_t)(argc > 2 ? atoi(argv[2]) : 16) * 1024 * 1024;
+    int max_dir_entries = argc > 3 ? atoi(argv[3]) : 1000;
+    size_t max_log_size = (size_t)(argc > 4 ? atoi(argv[4]) : 32) * 1024 * 1024;
+    if (file_size < LARGE_IO_SIZE || max_dir_entries < 10) {
+        printf("Usage: %s <mount_point> [file_size_mb] [max_dir_entries] [max_log_mb]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep everything in a directory of its own so that running twice on the same mount doesn't collide
+    snprintf(bench_dir, sizeof(bench_dir), "%s/bench%d", mount_point, getpid() % 100000);
+    make_dir(bench_dir);
+
+    printf("benchmark,parameter,value,unit\n");
+    bench_create();
+    bench_sequential(file_size);
+    bench_directory(max_dir_entries);
+    bench_log_length(max_log_size);
+    return 0;
+}